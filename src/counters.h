@@ -0,0 +1,73 @@
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Live node counters, published in a shared-memory segment (see
+// dw_node --shm-counters) and sampled by dw_top.
+//
+// Each thread_counters_t has a single writer thread and is protected
+// by a seqlock: the writer makes seq odd while updating, and readers
+// retry if they saw an odd or changed seq, so neither side needs
+// syscalls or locked instructions.
+
+#define COUNTERS_MAGIC 0x6477636e	// "dwcn"
+#define COUNTERS_MAX_THREADS 64
+
+typedef struct {
+  uint32_t seq;
+  uint64_t requests;		// messages processed
+  uint64_t bytes_in;		// bytes received
+  uint64_t bytes_out;		// bytes replied or forwarded
+  uint64_t conns_opened;	// connections accepted
+  uint64_t conns_closed;	// connections closed
+  uint64_t queue_depth;		// received messages not yet processed
+} __attribute__((aligned(64))) thread_counters_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t num_threads;		// entries in thr[] in use
+  pid_t pid;
+  thread_counters_t thr[COUNTERS_MAX_THREADS];
+} node_counters_t;
+
+static inline void counters_shm_name(char *name, size_t len, int port) {
+  snprintf(name, len, "/dw_node-%d", port);
+}
+
+// Data fields are stored with release and loaded with acquire
+// semantics (plain movs on x86), which keeps them ordered after the
+// odd seq store in the writer and before the seq re-check in readers
+static inline void counters_write_begin(thread_counters_t *c) {
+  __atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+}
+
+static inline void counters_write_end(thread_counters_t *c) {
+  __atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+}
+
+// single-writer c->field += v, within counters_write_begin/end()
+#define counters_add(c, field, v) \
+  __atomic_store_n(&(c)->field, (c)->field + (v), __ATOMIC_RELEASE)
+
+#define counters_set(c, field, v) \
+  __atomic_store_n(&(c)->field, (v), __ATOMIC_RELEASE)
+
+// consistent snapshot of *c into *dst
+static inline void counters_read(thread_counters_t *c, thread_counters_t *dst) {
+  uint32_t seq;
+  do {
+    seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+    dst->requests = __atomic_load_n(&c->requests, __ATOMIC_ACQUIRE);
+    dst->bytes_in = __atomic_load_n(&c->bytes_in, __ATOMIC_ACQUIRE);
+    dst->bytes_out = __atomic_load_n(&c->bytes_out, __ATOMIC_ACQUIRE);
+    dst->conns_opened = __atomic_load_n(&c->conns_opened, __ATOMIC_ACQUIRE);
+    dst->conns_closed = __atomic_load_n(&c->conns_closed, __ATOMIC_ACQUIRE);
+    dst->queue_depth = __atomic_load_n(&c->queue_depth, __ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&c->seq, __ATOMIC_RELAXED));
+  dst->seq = seq;
+}
+
+#endif
@@ -1,7 +1,9 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -14,15 +16,40 @@
 
 #include <pthread.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "message.h"
 #include "timespec.h"
 
 #include "cw_debug.h"
-#include "expon.h"
+#include "rng.h"
+#include "empirical.h"
+#include "replay.h"
+#include "trace.h"
+#include "samples.h"
+#include "histogram.h"
+#include "shm_ring.h"
 
 int exp_arrivals = 0;
+emp_dist_t emp_arrivals;	// shape of inter-send times, scaled to the rate
 int wait_spinning = 0;
+// --wait-hybrid: sleep until a slack before each send time, then spin,
+// the slack following the measured timer wake-up latency
+int wait_hybrid = 0;
+long wait_slack_ns = 50000;	// initial slack
+#define WAIT_SLACK_MIN_NS 1000
+#define WAIT_SLACK_MAX_NS 1000000
+long batch_window_ns = 0;	// requests due within this window are sent along with those due now
+int closed_loop = 0;		// users per connection in closed-loop mode (0 for open-loop)
+unsigned long think_time_us = 0;	// closed-loop think time (average, if exp_think)
+int exp_think = 0;
+int max_in_flight = 0;		// open-loop window of outstanding requests per connection (0 for none)
 int server_port = 7891;
 int bind_port = 0;
 
@@ -35,19 +62,47 @@ unsigned long load_nbytes = 10; 	// Number of bytes to be read from the server's
 unsigned int n_compute = 0;		// Number of COMPUTE requests
 unsigned long comptimes_us = 100;	// defaults to 100us
 int exp_comptimes = 0;
+emp_dist_t emp_comptimes;
 
 unsigned long pkt_size = 128;
 int exp_pkt_size = 0;
+emp_dist_t emp_pkt_size;
 
 unsigned long resp_size = 128;
 int exp_resp_size = 0;
+emp_dist_t emp_resp_size;
+
+// --replay: requests (command, sizes, send times) come from a trace,
+// indexed by pkt_id, so session k replays the slice starting at request
+// k * pkts_per_session, wrapping around to its start if -n exceeds its length
+char *replay_path = NULL;
+replay_rec_t *replay_recs = NULL;
+unsigned long replay_num = 0;
 
 int no_delay = 1;
 int per_session_output = 0;
+int samples_output = 1;		// print per-request samples
+
+int server_timestamps = 0;	// ask nodes for per-hop timestamps (MSG_TIMESTAMPS)
+
+// UDP mode (--udp): one message per datagram, lost requests being
+// detected by a timeout, and reordered replies matched by req_id
+int udp = 0;
+unsigned long udp_timeout_us = 100000;
+unsigned long max_msg_size = STREAM_MAX_SIZE;	// UDP_MAX_SIZE with --udp, BUF_SIZE with -sts
+int tcp_fastopen = 0;		// carry the first request in the SYN (TCP_FASTOPEN_CONNECT)
 
-#define MAX_THREADS 32
-pthread_t sender[MAX_THREADS];
-pthread_t receiver[MAX_THREADS];
+// Local transports to a co-located node: a Unix domain stream socket
+// (--unix), or shared-memory rings set up over one (--shm)
+char *unix_path = NULL;
+char *shm_path = NULL;
+uint32_t shm_size = SHM_RING_DEF_SIZE;	// bytes of each ring
+
+char *trace_path = NULL;
+unsigned long trace_size = 65536;	// events per thread
+
+int node_stats = 0;		// query and print node stats at the end
+int node_stats_reset = 0;	// reset node stats before starting
 
 void safe_send(int sock, unsigned char *buf, size_t len) {
   while (len > 0) {
@@ -80,8 +135,8 @@ int sum_w = 0;
 int weights[3] = {0,0,0}; //0 compute, 1 store, 2 load
 
 //Weighted command type picker
-command_type_t pick_next_cmd() {
-  int r = rand() % sum_w;
+command_type_t pick_next_cmd(rng_t *rng) {
+  int r = rng_below(rng, sum_w);
   int i = 0;
 
   while (r >= weights[i] && i < 3) {
@@ -96,11 +151,11 @@ command_type_t pick_next_cmd() {
 #define MIN_SEND_SIZE (sizeof(message_t) + 2*sizeof(command_t))
 #define MIN_REPLY_SIZE sizeof(message_t)
 
-uint32_t exp_packet_size(uint32_t avg, uint32_t min, uint32_t max, struct drand48_data* rnd_buf){
+uint32_t exp_packet_size(uint32_t avg, uint32_t min, uint32_t max, rng_t *rng){
   /* The pkt_size in input does not consider header size but I need to take
   * that into account if I want to generate an exponential distribution.
   */
-  uint32_t ret = lround(expon(1.0 / (avg+TCPIP_HEADERS_SIZE), rnd_buf));
+  uint32_t ret = lround(rng_expon(rng, 1.0 / (avg+TCPIP_HEADERS_SIZE)));
 
   if (ret >= TCPIP_HEADERS_SIZE)
     ret -= TCPIP_HEADERS_SIZE;
@@ -115,18 +170,65 @@ uint32_t exp_packet_size(uint32_t avg, uint32_t min, uint32_t max, struct drand4
     return ret;
 }
 
-#define MAX_PKTS 1000000
+// Empirical sizes are message sizes, clamped to [min, max]
+uint32_t emp_packet_size(emp_dist_t *d, uint32_t min, uint32_t max, rng_t *rng){
+  double v = emp_sample(d, rng);
+  if (v < min)
+    return min;
+  else if (v > max)
+    return max;
+  else
+    return lround(v);
+}
+
+// Map the --replay trace, checking its records against the limits of
+// this run before the experiment starts
+void replay_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  struct stat st;
+  sys_check(fstat(fd, &st));
+  check(st.st_size >= sizeof(replay_hdr_t));
+  replay_hdr_t *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  check(hdr != MAP_FAILED);
+  close(fd);
+  check(hdr->magic == REPLAY_MAGIC && hdr->rec_size == sizeof(replay_rec_t));
+  check(hdr->num_recs > 0 && st.st_size >= sizeof(replay_hdr_t) + hdr->num_recs * sizeof(replay_rec_t));
+  madvise(hdr, st.st_size, MADV_SEQUENTIAL);
+  replay_recs = (replay_rec_t *) (hdr + 1);
+  replay_num = hdr->num_recs;
+  for (unsigned long i = 0; i < replay_num; i++) {
+    replay_rec_t *r = &replay_recs[i];
+    unsigned long req = r->req_size + (r->cmd == STORE ? r->arg : 0);
+    unsigned long resp = r->resp_size + (r->cmd == LOAD ? r->arg : 0);
+    if ((r->cmd != COMPUTE && r->cmd != STORE && r->cmd != LOAD)
+        || r->req_size < MIN_SEND_SIZE || r->resp_size < MIN_REPLY_SIZE
+        || req > max_msg_size || resp > max_msg_size
+        || (i > 0 && r->ts_ns < r[-1].ts_ns)) {
+      fprintf(stderr, "%s: invalid request %lu (cmd %u, req_size %u, resp_size %u, arg %u), max message size %lu\n",
+              path, i, r->cmd, r->req_size, r->resp_size, r->arg, max_msg_size);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+#define DEF_NUM_PKTS 1000000
 #define MAX_RATES 1000000
 
 clockid_t clk_id = CLOCK_REALTIME;
-int clientSocket[MAX_THREADS];
-long usecs_send[MAX_THREADS][MAX_PKTS];
-long usecs_elapsed[MAX_THREADS][MAX_PKTS];
+// per-request samples are kept in per-worker files <samples_prefix>-<worker_id>.bin
+char *samples_prefix = NULL;	// NULL for unlinked temporary files
 // abs start-time of the experiment
 struct timespec ts_start;
 unsigned int rate = 1000;	// pkt/s rate (period is its inverse)
+unsigned int rate_start;	// rate at start, before any ramp
+int rate_epoch = 0;		// incremented when the search sets a new rate
 
-unsigned long num_pkts = MAX_PKTS;
+unsigned long num_pkts = DEF_NUM_PKTS;
+int num_pkts_set = 0;		// -n given
 
 unsigned int rates[MAX_RATES];
 unsigned int ramp_step_secs = 0;	// if non-zero, supersedes num_pkts
@@ -138,282 +240,1815 @@ char *hostname = "127.0.0.1";
 char *bindname = "0.0.0.0";
 
 struct sockaddr_in myaddr;
-struct sockaddr_in serveraddr;
-socklen_t addr_size;
 
-int num_threads = 1;
+// Backend nodes requests are balanced across, with lb_policy
+typedef struct {
+  char *host;
+  int port;
+  struct sockaddr_in addr;
+  uint64_t outstanding;		// requests in flight, across all workers
+} backend_t;
+
+backend_t *backends;
+int num_backends;
+char *servers;			// --servers list, NULL for just -sn:-sp
+
+typedef enum { LB_RR, LB_RANDOM, LB_P2C, LB_HASH } lb_policy_t;
+lb_policy_t lb_policy = LB_RR;
+const char *lb_policy_names[] = { "rr", "random", "p2c", "hash" };
+unsigned long hash_keys = 1000;	// LB_HASH: requests carry a key uniform in [0, hash_keys)
+
+#define HASH_VNODES 64		// points of each backend on the hash ring
+typedef struct {
+  uint64_t hash;
+  int backend;
+} ring_point_t;
+ring_point_t *ring;
+int ring_size;
+
+int num_conns = 1;
+int num_workers = 0;		// defaults to min(num_conns, online CPUs)
 int num_sessions = 1;
 
 unsigned long pkts_per_session;
 
+struct conn_info;
+
+// Connection of a client connection to one of the backends
+typedef struct {
+  struct conn_info *c;
+  int backend;
+  int sock;			// -1 while not connected
+  int connecting;		// non-blocking connect() in progress
+
+  unsigned char *recv_buf;	// replies being received, the oldest at the start
+  unsigned long recv_len;	// bytes in recv_buf
+  unsigned long recv_cap;	// size of recv_buf
+  unsigned long recv_skip;	// bytes still to receive of a reply larger than BUF_SIZE, beyond those kept
+
+  unsigned char *out_buf;	// request bytes not yet accepted by send()
+  unsigned long out_len;
+  unsigned long out_cap;
+  unsigned long out_fill;	// filler bytes to send after out_buf
+  int out_batch;		// requests at the end of out_buf batched by the current send round
+
+  uint64_t *pending;		// samples of outstanding requests, in send order
+  unsigned long pending_head;	// circular, index of oldest
+  unsigned long pending_len;
+  unsigned long pending_cap;	// power of 2
+
+  // --shm: rings replacing send() and recv() on sock, which is only
+  // watched for the node closing it
+  void *shm_map;
+  shm_ring_t *shm_tx;		// requests
+  shm_ring_t *shm_rx;		// replies
+  int shm_efd_in;		// signaled by the node on replies or room
+  int shm_efd_out;		// signaled to the node on requests or room
+} bconn_t;
+
+// Per-connection state, each connection being driven by one worker,
+// and made of one bconn_t per backend
+typedef struct conn_info {
+  int conn_id;
+  bconn_t *bc;			// bc[num_backends]
+  int num_up;			// bc[] connected
+  int num_blocked;		// bc[] with pending output
+  unsigned long rr_next;	// LB_RR: next backend
+  int sess_id;			// current session
+  unsigned long sess_sent;	// requests sent in current session
+  unsigned long sess_recv;	// replies received in current session
+  struct timespec ts_next;	// scheduled time of next send
+  struct timespec *ts_ready;	// closed-loop: times at which each idle user sends
+  int num_ready;
+  int heap_idx;			// position in worker send heap, -1 if not there
+  rng_t rng;
+  unsigned long period_rem;	// remainder of 1e9 / rate carried to the next period (ns)
+
+  uint64_t sess_first_sample;	// first sample of current session
+  int rate_epoch;		// last rate_epoch seen
+} conn_info_t;
+
+// Each worker multiplexes its connections over epoll, keeping those
+// with requests to send in a min-heap on their next send time, and
+// sleeping on a timerfd (or spinning) until the earliest one
 typedef struct {
-  int thread_id;
-  int first_pkt_id;
-  int num_send_pkts;
-} thread_data_t;
+  int worker_id;
+  pthread_t thread;
+  int epollfd;
+  int timerfd;
+  struct timespec ts_timer;	// current timerfd expiration
+  conn_info_t *conns;		// conns[0..num_conns-1] driven by this worker
+  int num_conns;
+  int active;			// conns not done with all sessions yet
+  conn_info_t **heap;
+  int heap_size;
+  unsigned char *send_buf;	// requests are built here
+  int batching;			// in a send round, see worker_send_due()
+  bconn_t **batch;		// bconns with requests batched in this round
+  int batch_size;
+  samples_t samples;
+  hist_t hist;			// elapsed times (us) of replied requests
+  hist_t hist_intended;		// same, but from their intended send times
+  hist_t hist_delay;		// send delays (us) w.r.t. intended send times
+  hist_t hist_pacing;		// same, in ns, for all requests
+  hist_t hist_wake;		// --wait-hybrid: timer wake-up latencies (ns)
+  long slack_ns;		// how early the timer is set before send times
+  uint64_t spin_ns;		// time spent spinning until send times
+  hist_t *backend_hist;		// elapsed times (us) per backend
+  int64_t last_reply_us;	// time of last reply since start of experiment
+
+  // read by the interval reporter while the worker updates them
+  uint64_t num_sent;
+  uint64_t num_replied;
+  uint64_t num_lost;		// sent but not replied, due to a premature end of session or a UDP timeout
+  uint64_t num_timeouts;	// UDP requests given up on after udp_timeout_us
+  uint64_t num_reordered;	// UDP replies overtaking ones to older requests
+  uint64_t num_late;		// UDP replies after their timeout, or duplicated
+  struct timespec ts_expire;	// UDP: next check for timed-out requests
+  hist_t ival_hist[2];		// elapsed times (us) in the current and previous interval
+  int ival_cur;			// ival_hist[] being added to, swapped by the reporter
+} worker_info_t;
+
+#define MAX_EVENTS 64
+#define SEND_BATCH 64		// max requests per send round
+#define RECV_CHUNK 16384	// initial reply buffer size, i.e., bytes asked for by each recv()
+
+conn_info_t *conns;
+worker_info_t *workers;
+
+double report_interval = 0;	// secs between interval reports, 0 to disable
+int stop_sending = 0;		// set to make workers stop early
+int send_paused = 0;		// set to make workers hold sends (while draining)
+
+// Search of the max rate meeting the SLO: hist_percentile(slo_perc) < slo_us
+double slo_perc = 0;		// 0 if not searching
+unsigned long slo_us = 0;
+double search_warmup_secs = 1;	// per step, excluded from the measurement
+double search_secs = 5;		// per step, measurement window
+unsigned int search_precision = 0;	// req/s, defaults to 1% of the start rate
+unsigned int search_max_rate = 1000000;
+
+// Exclusion of transients from the summary
+double warmup_secs = 0;		// skip samples sent in the first warmup_secs
+double cooldown_secs = 0;	// skip samples sent in the last cooldown_secs
+unsigned long warmup_pkts = 0;	// skip the first warmup_pkts of each session
+unsigned long cooldown_pkts = 0;	// skip the last cooldown_pkts of each session
+int steady_state = 0;		// skip samples before the detected steady state
+double steady_window_secs = 1;
+#define STEADY_WINDOWS 5
+double steady_tol = 0.1;
+int64_t measure_from_us = 0;
+int64_t measure_to_us = INT64_MAX;
+pthread_t reporter;
+int workers_done = 0;
+pthread_mutex_t reporter_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reporter_cond = PTHREAD_COND_INITIALIZER;
+
+// single-writer *p += v, with p read concurrently by the reporter
+#define stat_add(p, v) __atomic_store_n((p), *(p) + (v), __ATOMIC_RELAXED)
+
+// in ns and as a double, not to lose precision at millions of req/s
+double curr_period_ns() {
+  return 1e9 / rate;
+}
 
-unsigned long curr_period_us() {
-  return 1000000 / rate;
+// Split the elapsed time of pkt_id using the hop stamps in the trailer
+// of its reply m: network-out is measured from our send time to the
+// first hop receive time, so it assumes clocks synchronized with the
+// node(s); network-back includes anything not spent within nodes
+void compute_breakdown(sample_t *sm, message_t *m) {
+  int32_t *bd = sm->bd;
+  uint32_t n = trailer_num_hops(m);
+  check(m->req_size >= sizeof(message_t) + TRAILER_SIZE(n));
+  uint64_t send_ns = ts_to_ns(ts_start) + sm->send_us * 1000;
+  bd[BD_QUEUE] = bd[BD_SERVICE] = 0;
+  for (int i = 0; i < n; i++) {
+    hop_stamps_t hs;
+    trailer_get_hop(m, n, i, &hs);
+    if (i == 0)
+      bd[BD_NET_OUT] = ((long) (hs.recv_ns - send_ns)) / 1000;
+    bd[BD_QUEUE] += (hs.start_ns - hs.recv_ns) / 1000;
+    bd[BD_SERVICE] += (hs.send_ns - hs.start_ns) / 1000;
+  }
+  if (n == 0)
+    bd[BD_NET_OUT] = 0;
+  bd[BD_NET_BACK] = sm->elapsed_us - bd[BD_NET_OUT] - bd[BD_QUEUE] - bd[BD_SERVICE];
+  sm->flags |= SAMPLE_BREAKDOWN;
 }
 
-int idx(int pkt_id) {
-  int val = per_session_output ? pkt_id % pkts_per_session : pkt_id;
-  assert(val < MAX_PKTS);
-  return val;
+void print_sample(sample_t *sm) {
+  printf("t: %ld us, elapsed: %ld us, req_id: %u, thr_id: %u, sess_id: %u, delay: %ld us", sm->send_us, sm->elapsed_us, sm->req_id, sm->conn_id, sm->sess_id, sm->send_us - sm->intended_us);
+  if (num_backends > 1)
+    printf(", backend: %u", sm->backend);
+  if (server_timestamps) {
+    int32_t *bd = sm->bd;
+    printf(", net_out: %d us, queue: %d us, service: %d us, net_back: %d us",
+           bd[BD_NET_OUT], bd[BD_QUEUE], bd[BD_SERVICE], bd[BD_NET_BACK]);
+  }
+  printf("\n");
 }
 
-void *thread_sender(void *data) {
-  thread_data_t *p = (thread_data_t *)data;
-  int thread_id = p->thread_id;
-  int first_pkt_id = p->first_pkt_id;
-  int num_send_pkts = p->num_send_pkts;
-  unsigned char *send_buf = malloc(BUF_SIZE);
-  check(send_buf != NULL);
-  struct timespec ts_now;
-  struct drand48_data rnd_buf;
+// atomically decrement *n if positive, returning whether it was
+int take_one(unsigned int *n) {
+  unsigned int v = __atomic_load_n(n, __ATOMIC_RELAXED);
+  while (v > 0)
+    if (__atomic_compare_exchange_n(n, &v, v - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
 
-  clock_gettime(clk_id, &ts_now);
-  srand48_r(time(NULL), &rnd_buf);
-
-  int rate_start = rate;
-
-  for (int i = 0; i < num_send_pkts; i++) {
-    /* remember time of send relative to ts_start */
-    struct timespec ts_send;
-    clock_gettime(clk_id, &ts_send);
-    int pkt_id = first_pkt_id + i;
-    usecs_send[thread_id][idx(pkt_id)] = ts_sub_us(ts_send, ts_start);
-    // mark corresponding elapsed value as 0, i.e., non-valid (in case we don't receive all packets back)
-    usecs_elapsed[thread_id][idx(pkt_id)] = 0;
-    /*---- Issue a request to the server ---*/
-    message_t *m = (message_t *) send_buf;
-    m->req_id = pkt_id;
-
-    if (exp_pkt_size){
-      m->req_size = exp_packet_size(pkt_size, MIN_SEND_SIZE, BUF_SIZE, &rnd_buf);
-    } else{
-      m->req_size = pkt_size;
-    }
-
-    m->num = 2;
-    command_type_t next_cmd;
-
-    if (sum_w > 0) { //weighted pick
-      next_cmd = pick_next_cmd();
-    } else { //request prioritY: COMPUTE>STORE>LOAD
-      if (n_compute > 0) {
-        n_compute--;
-        next_cmd = COMPUTE;
-      } else if (n_store > 0) {
-        n_store--;
-        next_cmd = STORE;
-      } else if (n_load > 0) {
-        n_load--;
-        next_cmd = LOAD;
-      } else { //COMPUTE by default
-        next_cmd = COMPUTE;
-      }
-    }
+// 64-bit mix function (splitmix64 finalizer), for the hash ring
+static inline uint64_t hash64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ul;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebul;
+  x ^= x >> 31;
+  return x;
+}
 
-    m->cmds[0].cmd = next_cmd;
-    // TODO: trunc pkt/resp size to BUF_SIZE when using the --exp- variants.
-    m->cmds[1].cmd = REPLY;
+int ring_cmp(const void *a, const void *b) {
+  uint64_t ha = ((ring_point_t *) a)->hash, hb = ((ring_point_t *) b)->hash;
+  return ha < hb ? -1 : ha > hb;
+}
 
-    if (m->cmds[0].cmd == COMPUTE) {
-      if (exp_comptimes) {
-        m->cmds[0].u.comp_time_us = lround(expon(1.0 / comptimes_us, &rnd_buf));
-      } else {
-        m->cmds[0].u.comp_time_us = comptimes_us;
-      }
-    } else if (m->cmds[0].cmd == STORE) {
-      m->cmds[0].u.store_nbytes = store_nbytes;
-      m->req_size += store_nbytes;
-    } else if (m->cmds[0].cmd == LOAD ){
-      m->cmds[0].u.load_nbytes = load_nbytes;
-    } else {
-      printf("Unexpected branch (2)\n");
-      exit(EXIT_FAILURE);
+// Place HASH_VNODES points of each backend on the hash ring, so that
+// adding or removing a backend only remaps the keys of its own arcs
+void ring_build() {
+  ring_size = num_backends * HASH_VNODES;
+  ring = malloc(ring_size * sizeof(ring[0]));
+  check(ring != NULL);
+  for (int b = 0; b < num_backends; b++) {
+    uint64_t id = ((uint64_t) ntohl(backends[b].addr.sin_addr.s_addr) << 16) | backends[b].port;
+    for (int v = 0; v < HASH_VNODES; v++)
+      ring[b * HASH_VNODES + v] = (ring_point_t) { hash64(id * HASH_VNODES + v), b };
+  }
+  qsort(ring, ring_size, sizeof(ring[0]), ring_cmp);
+}
+
+// backend of the first ring point clockwise from the hash of key
+int ring_lookup(uint64_t key) {
+  uint64_t h = hash64(key);
+  int lo = 0, hi = ring_size;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return ring[lo == ring_size ? 0 : lo].backend;
+}
+
+// Backend the next request of c goes to, according to lb_policy
+int pick_backend(conn_info_t *c) {
+  if (num_backends == 1)
+    return 0;
+  switch (lb_policy) {
+  case LB_RR:
+    return c->rr_next++ % num_backends;
+  case LB_RANDOM:
+    return rng_below(&c->rng, num_backends);
+  case LB_P2C: {
+    // the less loaded of two distinct random backends
+    int b1 = rng_below(&c->rng, num_backends);
+    int b2 = (b1 + 1 + rng_below(&c->rng, num_backends - 1)) % num_backends;
+    uint64_t o1 = __atomic_load_n(&backends[b1].outstanding, __ATOMIC_RELAXED);
+    uint64_t o2 = __atomic_load_n(&backends[b2].outstanding, __ATOMIC_RELAXED);
+    return o2 < o1 ? b2 : b1;
+  }
+  case LB_HASH:
+    return ring_lookup(rng_below(&c->rng, hash_keys));
+  }
+  return 0;
+}
+
+// Build request pkt_id of c into send_buf, returning its size
+uint32_t build_request(conn_info_t *c, unsigned char *send_buf, unsigned long pkt_id) {
+  message_t *m = (message_t *) send_buf;
+  m->req_id = pkt_id;
+  m->flags = server_timestamps ? MSG_TIMESTAMPS : 0;
+  replay_rec_t *rec = replay_recs != NULL ? &replay_recs[pkt_id % replay_num] : NULL;
+  unsigned long load_bytes = rec != NULL ? rec->arg : load_nbytes;
+
+  // sizes summed in unsigned long, and drawn leaving room for STORE data, so that
+  // they fit max_msg_size as checked at startup (and for the trace when loaded)
+  unsigned long req_size;
+  if (rec != NULL) {
+    req_size = rec->req_size;
+  } else if (emp_pkt_size.n > 0) {
+    req_size = emp_packet_size(&emp_pkt_size, MIN_SEND_SIZE, max_msg_size - store_nbytes, &c->rng);
+  } else if (exp_pkt_size){
+    req_size = exp_packet_size(pkt_size, MIN_SEND_SIZE, max_msg_size - store_nbytes, &c->rng);
+  } else{
+    req_size = pkt_size;
+  }
+
+  m->num = 2;
+  command_type_t next_cmd;
+
+  if (rec != NULL) {
+    next_cmd = rec->cmd;
+  } else if (sum_w > 0) { //weighted pick
+    next_cmd = pick_next_cmd(&c->rng);
+  } else { //request prioritY: COMPUTE>STORE>LOAD
+    if (take_one(&n_compute)) {
+      next_cmd = COMPUTE;
+    } else if (take_one(&n_store)) {
+      next_cmd = STORE;
+    } else if (take_one(&n_load)) {
+      next_cmd = LOAD;
+    } else { //COMPUTE by default
+      next_cmd = COMPUTE;
     }
+  }
 
-    if (exp_resp_size){
-       m->cmds[1].u.fwd.pkt_size = exp_packet_size(resp_size, MIN_REPLY_SIZE, BUF_SIZE, &rnd_buf);
+  m->cmds[0].cmd = next_cmd;
+  // TODO: trunc pkt/resp size to BUF_SIZE when using the --exp- variants.
+  m->cmds[1].cmd = REPLY;
+
+  if (m->cmds[0].cmd == COMPUTE) {
+    if (rec != NULL) {
+      m->cmds[0].u.comp_time_us = rec->arg;
+    } else if (emp_comptimes.n > 0) {
+      m->cmds[0].u.comp_time_us = lround(emp_sample(&emp_comptimes, &c->rng));
+    } else if (exp_comptimes) {
+      m->cmds[0].u.comp_time_us = lround(rng_expon(&c->rng, 1.0 / comptimes_us));
     } else {
-      assert(resp_size <= BUF_SIZE);
-      m->cmds[1].u.fwd.pkt_size = resp_size;
+      m->cmds[0].u.comp_time_us = comptimes_us;
     }
+  } else if (m->cmds[0].cmd == STORE) {
+    m->cmds[0].u.store_nbytes = rec != NULL ? rec->arg : store_nbytes;
+    req_size += m->cmds[0].u.store_nbytes;
+  } else if (m->cmds[0].cmd == LOAD ){
+    m->cmds[0].u.load_nbytes = load_bytes;
+  } else {
+    printf("Unexpected branch (2)\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (rec != NULL) {
+    m->cmds[1].u.fwd.pkt_size = rec->resp_size;
+  } else if (emp_resp_size.n > 0) {
+    m->cmds[1].u.fwd.pkt_size = emp_packet_size(&emp_resp_size, MIN_REPLY_SIZE, max_msg_size, &c->rng);
+  } else if (exp_resp_size){
+     m->cmds[1].u.fwd.pkt_size = exp_packet_size(resp_size, MIN_REPLY_SIZE, max_msg_size, &c->rng);
+  } else {
+    assert(resp_size <= max_msg_size);
+    m->cmds[1].u.fwd.pkt_size = resp_size;
+  }
+
+  m->req_size = req_size;
+  if (server_timestamps) {
+    // room for an empty trailer
+    if (m->req_size < MIN_SEND_SIZE + TRAILER_SIZE(0))
+      m->req_size = MIN_SEND_SIZE + TRAILER_SIZE(0);
+    memset(send_buf + m->req_size - TRAILER_SIZE(0), 0, TRAILER_SIZE(0));
+  }
+
+  uint32_t return_bytes = m->cmds[1].u.fwd.pkt_size;
+  if (m->cmds[0].cmd == LOAD) {
+    return_bytes += load_bytes;
+  }
+
+  cw_log("%s: sending %u bytes (will expect %u bytes in response)...\n", get_command_name(next_cmd), m->req_size,
+                                                                         return_bytes);
+  return m->req_size;
+}
+
+// Outstanding requests of a bconn, usually replied to in send order
+
+void pending_push(bconn_t *c, uint64_t sample) {
+  if (c->pending_len == c->pending_cap) {
+    unsigned long old_cap = c->pending_cap;
+    c->pending_cap = old_cap ? 2 * old_cap : 16;
+    c->pending = realloc(c->pending, c->pending_cap * sizeof(c->pending[0]));
+    check(c->pending != NULL);
+    // unwrap entries past the old end
+    for (unsigned long i = 0; i < c->pending_head; i++)
+      c->pending[old_cap + i] = c->pending[i];
+  }
+  c->pending[(c->pending_head + c->pending_len++) & (c->pending_cap - 1)] = sample;
+}
+
+uint64_t pending_pop(bconn_t *c) {
+  assert(c->pending_len > 0);
+  uint64_t sample = c->pending[c->pending_head];
+  c->pending_head = (c->pending_head + 1) & (c->pending_cap - 1);
+  c->pending_len--;
+  return sample;
+}
+
+// Remove the outstanding request pkt_id, usually the oldest one,
+// unless replies were reordered (e.g., by a dw_node --proxy across
+// backends, or over UDP); returns NO_SAMPLE if not outstanding (UDP)
+#define NO_SAMPLE UINT64_MAX
+uint64_t pending_take(worker_info_t *w, bconn_t *c, uint32_t pkt_id) {
+  unsigned long mask = c->pending_cap - 1;
+  for (unsigned long i = 0; i < c->pending_len; i++) {
+    uint64_t sample = c->pending[(c->pending_head + i) & mask];
+    if (samples_get(&w->samples, sample)->req_id != pkt_id)
+      continue;
+    if (i > 0 && udp)
+      stat_add(&w->num_reordered, 1);
+    // shift the older ones forward into its place
+    for (; i > 0; i--)
+      c->pending[(c->pending_head + i) & mask] = c->pending[(c->pending_head + i - 1) & mask];
+    c->pending[c->pending_head] = sample;
+    return pending_pop(c);
+  }
+  if (udp) {
+    stat_add(&w->num_late, 1);
+    return NO_SAMPLE;
+  }
+  fprintf(stderr, "Error: reply to unknown req_id %u\n", pkt_id);
+  exit(EXIT_FAILURE);
+}
+
+// Min-heap of the conns of a worker that have requests to send, on ts_next
 
-    uint32_t return_bytes = m->cmds[1].u.fwd.pkt_size;
-    if (m->cmds[0].cmd == LOAD) {
-      return_bytes += load_nbytes;
+void heap_swap(worker_info_t *w, int i, int j) {
+  conn_info_t *c = w->heap[i];
+  w->heap[i] = w->heap[j];
+  w->heap[j] = c;
+  w->heap[i]->heap_idx = i;
+  w->heap[j]->heap_idx = j;
+}
+
+void heap_down(worker_info_t *w, int i) {
+  while (1) {
+    int min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < w->heap_size && ts_leq(w->heap[l]->ts_next, w->heap[min]->ts_next))
+      min = l;
+    if (r < w->heap_size && ts_leq(w->heap[r]->ts_next, w->heap[min]->ts_next))
+      min = r;
+    if (min == i)
+      return;
+    heap_swap(w, i, min);
+    i = min;
+  }
+}
+
+void heap_up(worker_info_t *w, int i) {
+  while (i > 0 && ts_leq(w->heap[i]->ts_next, w->heap[(i - 1) / 2]->ts_next)) {
+    heap_swap(w, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void heap_del(worker_info_t *w, conn_info_t *c) {
+  int i = c->heap_idx;
+  if (i < 0)
+    return;
+  heap_swap(w, i, --w->heap_size);
+  c->heap_idx = -1;
+  if (i < w->heap_size) {
+    heap_down(w, i);
+    heap_up(w, i);
+  }
+}
+
+// (Re-)insert c in the send heap if it has requests to send and is not
+// waiting for pending output to be flushed
+void conn_sched(worker_info_t *w, conn_info_t *c) {
+  int sending = c->num_up == num_backends && c->sess_sent < pkts_per_session && c->num_blocked == 0;
+  if (closed_loop)
+    sending = sending && c->num_ready > 0;
+  else if (max_in_flight > 0)
+    sending = sending && c->sess_sent - c->sess_recv < max_in_flight;
+  if (sending && c->heap_idx < 0) {
+    c->heap_idx = w->heap_size++;
+    w->heap[c->heap_idx] = c;
+    heap_up(w, c->heap_idx);
+  } else if (!sending) {
+    heap_del(w, c);
+  }
+}
+
+// closed-loop: index of the idle user sending first
+int conn_first_ready(conn_info_t *c) {
+  int first = 0;
+  for (int i = 1; i < c->num_ready; i++)
+    if (ts_leq(c->ts_ready[i], c->ts_ready[first]))
+      first = i;
+  return first;
+}
+
+// closed-loop: earliest send time among idle users into ts_next
+void conn_next_ready(conn_info_t *c) {
+  if (c->num_ready > 0)
+    c->ts_next = c->ts_ready[conn_first_ready(c)];
+}
+
+// Start sending over the just connected c: right away in open-loop
+// mode, or with all users ready in closed-loop mode
+void conn_start(worker_info_t *w, conn_info_t *c) {
+  clock_gettime(clk_id, &c->ts_next);
+  if (closed_loop) {
+    for (int i = 0; i < closed_loop; i++)
+      c->ts_ready[i] = c->ts_next;
+    c->num_ready = closed_loop;
+  }
+  conn_sched(w, c);
+}
+
+void bconn_epoll_mod(worker_info_t *w, bconn_t *b, uint32_t events) {
+  struct epoll_event ev = { .events = events, .data.ptr = b };
+  sys_check(epoll_ctl(w->epollfd, EPOLL_CTL_MOD, b->sock, &ev));
+}
+
+// Connect b to the node over --unix or --shm, which completes right away
+void bconn_connect_local(worker_info_t *w, bconn_t *b) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, shm_path ? shm_path : unix_path, sizeof(addr.sun_path) - 1);
+  sys_check(b->sock = socket(AF_UNIX, SOCK_STREAM, 0));
+  cw_log("Connecting conn %d (sess_id=%d) to %s...\n", b->c->conn_id, b->c->sess_id, addr.sun_path);
+  sys_check(connect(b->sock, (struct sockaddr *) &addr, sizeof(addr)));
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = b };
+  if (shm_path) {
+    int fds[SHM_FD_NUM];
+    unsigned long map_size = shm_map_size(shm_size);
+    sys_check(fds[SHM_FD_MEM] = memfd_create("dw_client", 0));
+    sys_check(ftruncate(fds[SHM_FD_MEM], map_size));
+    b->shm_map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_MEM], 0);
+    check(b->shm_map != MAP_FAILED);
+    b->shm_tx = shm_ring_get(b->shm_map, shm_size, SHM_RING_REQ);
+    b->shm_rx = shm_ring_get(b->shm_map, shm_size, SHM_RING_REPLY);
+    b->shm_tx->size = b->shm_rx->size = shm_size;
+    // both consumers start asleep, so the first message signals them
+    b->shm_tx->cons_waiting = b->shm_rx->cons_waiting = 1;
+    sys_check(fds[SHM_FD_TO_NODE] = b->shm_efd_out = eventfd(0, EFD_NONBLOCK));
+    sys_check(fds[SHM_FD_TO_CLIENT] = b->shm_efd_in = eventfd(0, EFD_NONBLOCK));
+    sys_check(shm_send_fds(b->sock, fds));
+    close(fds[SHM_FD_MEM]);
+    sys_check(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, b->shm_efd_in, &ev));
+    ev.events = EPOLLRDHUP;
+  }
+  sys_check(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, b->sock, &ev));
+
+  b->connecting = 0;
+  if (++b->c->num_up == num_backends)
+    conn_start(w, b->c);
+}
+
+void bconn_close(worker_info_t *w, bconn_t *b) {
+  close(b->sock);
+  b->sock = -1;
+  if (b->shm_map != NULL) {
+    // the node holds the same eventfds, so closing them does not remove them from epoll
+    sys_check(epoll_ctl(w->epollfd, EPOLL_CTL_DEL, b->shm_efd_in, NULL));
+    close(b->shm_efd_in);
+    close(b->shm_efd_out);
+    munmap(b->shm_map, shm_map_size(shm_size));
+    b->shm_map = NULL;
+    b->shm_tx = b->shm_rx = NULL;
+  }
+}
+
+void bconn_connect(worker_info_t *w, bconn_t *b) {
+  if (unix_path || shm_path) {
+    bconn_connect_local(w, b);
+    return;
+  }
+
+  /*---- Create the socket. The three arguments are: ----*/
+  /* 1) Internet domain 2) Stream socket 3) Default protocol (TCP in this case) */
+  sys_check(b->sock = socket(PF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0));
+
+  if (!udp)
+    sys_check(setsockopt(b->sock, IPPROTO_TCP, TCP_NODELAY, (void *)&no_delay, sizeof(no_delay)));
+  if (tcp_fastopen) {
+    // connect() then completes right away, the handshake starting with the first send()
+    int val = 1;
+    sys_check(setsockopt(b->sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void *)&val, sizeof(val)));
+  }
+
+  cw_log("Binding to %s:%d\n", inet_ntoa(myaddr.sin_addr), myaddr.sin_port);
+
+  /*---- Bind the address struct to the socket ----*/
+  sys_check(bind(b->sock, (struct sockaddr *) &myaddr, sizeof(myaddr)));
+
+  /*---- Connect the socket to the server using the address struct ----*/
+  /* without blocking the other conns of the worker: completion is notified with EPOLLOUT */
+  /* (with UDP, this just sets the default destination, and completes right away) */
+  cw_log("Connecting conn %d (sess_id=%d) to backend %d...\n", b->c->conn_id, b->c->sess_id, b->backend);
+  sys_check(fcntl(b->sock, F_SETFL, fcntl(b->sock, F_GETFL, 0) | O_NONBLOCK));
+  int rv = connect(b->sock, (struct sockaddr *) &backends[b->backend].addr, sizeof(backends[b->backend].addr));
+  if (rv < 0 && errno != EINPROGRESS) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  b->connecting = (rv < 0);
+
+  struct epoll_event ev = { .events = b->connecting ? EPOLLOUT : EPOLLIN, .data.ptr = b };
+  sys_check(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, b->sock, &ev));
+
+  if (!b->connecting && ++b->c->num_up == num_backends)
+    conn_start(w, b->c);
+}
+
+// Connect c to all backends, starting to send once all are connected
+void conn_connect(worker_info_t *w, conn_info_t *c) {
+  c->num_up = 0;
+  for (int i = 0; i < num_backends; i++)
+    bconn_connect(w, &c->bc[i]);
+}
+
+// EPOLLOUT while connecting
+void bconn_connected(worker_info_t *w, bconn_t *b) {
+  int err;
+  socklen_t len = sizeof(err);
+  sys_check(getsockopt(b->sock, SOL_SOCKET, SO_ERROR, &err, &len));
+  if (err != 0) {
+    errno = err;
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  cw_log("Conn %d connected to backend %d\n", b->c->conn_id, b->backend);
+  b->connecting = 0;
+  bconn_epoll_mod(w, b, EPOLLIN);
+  if (++b->c->num_up == num_backends)
+    conn_start(w, b->c);
+}
+
+// Close the session of c, which is complete unless skip_pkts > 0, and
+// move to the next one, if any
+void conn_end_session(worker_info_t *w, conn_info_t *c, unsigned long skip_pkts) {
+  stat_add(&w->num_lost, c->sess_sent - c->sess_recv);
+  if (skip_pkts > 0) {
+    printf("ERROR: conn %d lost %lu pkts! Forcing premature end of session!\n", c->conn_id, skip_pkts);
+  }
+  cw_log("Session %d of conn %d is over, closing socket\n", c->sess_id, c->conn_id);
+  heap_del(w, c);
+  for (int i = 0; i < num_backends; i++) {
+    bconn_t *b = &c->bc[i];
+    bconn_close(w, b);
+    __atomic_fetch_sub(&backends[i].outstanding, b->pending_len, __ATOMIC_RELAXED);
+    b->recv_len = b->recv_skip = b->out_len = b->out_fill = 0;
+    b->out_batch = 0;
+    b->pending_head = b->pending_len = 0;
+  }
+  c->num_up = c->num_blocked = 0;
+  if (per_session_output && samples_output) {
+    for (uint64_t i = c->sess_first_sample; i < samples_num(&w->samples); i++) {
+      sample_t *sm = samples_get(&w->samples, i);
+      if (sm->conn_id == c->conn_id && sm->sess_id == c->sess_id)
+        print_sample(sm);
+    }
+  }
+  c->sess_id++;
+  c->sess_sent = c->sess_recv = 0;
+  c->sess_first_sample = samples_num(&w->samples);
+  if (c->sess_id < num_sessions)
+    conn_connect(w, c);
+  else
+    w->active--;
+}
+
+// Send what c accepts right away of len bytes of buf, through its ring
+// with --shm (then armed to signal when there is room); returns the
+// bytes sent, or -1 if the connection failed
+long bconn_send(bconn_t *c, unsigned char *buf, unsigned long len) {
+  long sent = 0;
+  if (c->shm_tx != NULL) {
+    do {
+      sent += shm_ring_write(c->shm_tx, buf + sent, len - sent);
+      if (shm_ring_cons_wakeup(c->shm_tx))
+        sys_check(eventfd_write(c->shm_efd_out, 1));
+    } while (sent < len && !shm_ring_prod_wait(c->shm_tx));
+    return sent;
+  }
+  while (sent < len) {
+    long n = send(c->sock, buf + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    // EINPROGRESS: TFO without a cookie yet, the data goes after the handshake
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS))
+      break;
+    if (n < 0) {
+      perror("send");
+      return -1;
+    }
+    sent += n;
+  }
+  cw_log("Sent %ld bytes.\n", sent);
+  return sent;
+}
+
+// Send what c accepts right away of its c->out_fill filler bytes, taken
+// from w->send_buf; returns -1 if the connection failed
+int bconn_send_fill(worker_info_t *w, bconn_t *c) {
+  while (c->out_fill > 0) {
+    unsigned long len = c->out_fill < BUF_SIZE ? c->out_fill : BUF_SIZE;
+    long sent = bconn_send(c, w->send_buf, len);
+    if (sent < 0)
+      return -1;
+    c->out_fill -= sent;
+    if (sent < len)
+      break;
+  }
+  return 0;
+}
+
+// Send the c->out_batch requests batched in c->out_buf by the current
+// send round with a single syscall: one send() of all of them (queueing
+// the rest as bconn_write() does), or one sendmmsg() of a datagram each
+// with UDP; returns 0 if the connection failed
+int bconn_send_batch(worker_info_t *w, bconn_t *c) {
+  if (udp) {
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovs[SEND_BATCH];
+    int n = 0;
+    for (unsigned long off = 0; off < c->out_len; off += iovs[n++].iov_len) {
+      iovs[n].iov_base = c->out_buf + off;
+      iovs[n].iov_len = ((message_t *) (c->out_buf + off))->req_size;
+      msgs[n].msg_hdr = (struct msghdr) { .msg_iov = &iovs[n], .msg_iovlen = 1 };
+    }
+    c->out_len = c->out_batch = 0;
+    for (int i = 0; i < n; ) {
+      int sent = sendmmsg(c->sock, msgs + i, n - i, MSG_DONTWAIT);
+      if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+          perror("sendmmsg");
+          return 0;
+        }
+        // datagrams the socket buffer cannot take are lost, as on the network
+        sent = 1;
+      }
+      i += sent;
+    }
+    return 1;
+  }
+  c->out_batch = 0;
+  long sent = bconn_send(c, c->out_buf, c->out_len);
+  if (sent < 0)
+    return 0;
+  memmove(c->out_buf, c->out_buf + sent, c->out_len - sent);
+  c->out_len -= sent;
+  if (c->out_len > 0) {
+    // the rest goes on EPOLLOUT, or when the node signals room with --shm
+    if (c->shm_tx == NULL)
+      bconn_epoll_mod(w, c, EPOLLIN | EPOLLOUT);
+    c->c->num_blocked++;
+    conn_sched(w, c->c);
+  }
+  return 1;
+}
+
+// Send len bytes of buf over c, followed by fill bytes of filler (the
+// rest of requests larger than BUF_SIZE), queueing what the socket does
+// not accept right away in c->out_buf and c->out_fill, to be sent on
+// EPOLLOUT; returns 0 if the connection failed
+int bconn_write(worker_info_t *w, bconn_t *c, unsigned char *buf, unsigned long len, unsigned long fill) {
+  long sent = 0;
+  int idle = (c->out_len == 0 && c->out_fill == 0);
+  if (w->batching && fill == 0 && (idle || c->out_batch > 0)) {
+    // sent at the end of the round, along with any other requests to c
+    if (c->out_len + len > c->out_cap) {
+      c->out_cap = 2 * (c->out_len + len);
+      c->out_buf = realloc(c->out_buf, c->out_cap);
+      check(c->out_buf != NULL);
     }
+    memcpy(c->out_buf + c->out_len, buf, len);
+    c->out_len += len;
+    if (c->out_batch++ == 0)
+      w->batch[w->batch_size++] = c;
+    return 1;
+  }
+  // filler cannot be batched: send the batch first, so as to keep the order
+  if (c->out_batch > 0) {
+    if (!bconn_send_batch(w, c))
+      return 0;
+    idle = (c->out_len == 0 && c->out_fill == 0);
+  }
+  if (udp) {
+    // datagrams the socket buffer cannot take are lost, as on the network
+    if (send(c->sock, buf, len, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+      perror("send");
+      return 0;
+    }
+    return 1;
+  }
+  // filler comes last: nothing is sent while blocked (see conn_sched())
+  assert(idle || c->out_fill == 0);
+  if (idle && (sent = bconn_send(c, buf, len)) < 0)
+    return 0;
+  if (c->out_len + len - sent > c->out_cap) {
+    c->out_cap = c->out_len + len - sent;
+    c->out_buf = realloc(c->out_buf, c->out_cap);
+    check(c->out_buf != NULL);
+  }
+  memcpy(c->out_buf + c->out_len, buf + sent, len - sent);
+  c->out_len += len - sent;
+  c->out_fill += fill;
+  if (idle) {
+    if (c->out_len == 0 && bconn_send_fill(w, c) < 0)
+      return 0;
+    if (c->out_len == 0 && c->out_fill == 0)
+      return 1;
+    // the rest goes on EPOLLOUT, or when the node signals room with --shm
+    if (c->shm_tx == NULL)
+      bconn_epoll_mod(w, c, EPOLLIN | EPOLLOUT);
+    c->c->num_blocked++;
+  }
+  return 1;
+}
 
-    cw_log("%s: sending %u bytes (will expect %u bytes in response)...\n", get_command_name(next_cmd), m->req_size,
-	                                                                   return_bytes);
-    assert(m->req_size <= BUF_SIZE);
-    safe_send(clientSocket[thread_id], send_buf, m->req_size);
+// EPOLLOUT (or room in the --shm ring): try to send pending output
+int bconn_flush(worker_info_t *w, bconn_t *c) {
+  long sent = bconn_send(c, c->out_buf, c->out_len);
+  if (sent < 0)
+    return 0;
+  memmove(c->out_buf, c->out_buf + sent, c->out_len - sent);
+  c->out_len -= sent;
+  if (c->out_len == 0 && bconn_send_fill(w, c) < 0)
+    return 0;
+  if (c->out_len == 0 && c->out_fill == 0) {
+    if (c->shm_tx == NULL)
+      bconn_epoll_mod(w, c, EPOLLIN);
+    c->c->num_blocked--;
+    conn_sched(w, c->c);
+  }
+  return 1;
+}
 
-    unsigned long period_us = curr_period_us();
+void conn_send_request(worker_info_t *w, conn_info_t *c) {
+  /* remember time of send relative to ts_start */
+  struct timespec ts_send;
+  clock_gettime(clk_id, &ts_send);
+  // 64-bit, as searches run for up to 2^62 requests; req_id on the
+  // wire, and in samples, keeps its low 32 bits
+  unsigned long pkt_id = c->sess_id * pkts_per_session + c->sess_sent;
+  // elapsed_us stays 0, i.e., non-valid, in case we don't receive the reply
+  uint64_t si = samples_append(&w->samples);
+  sample_t *sm = samples_get(&w->samples, si);
+  sm->send_us = ts_sub_us(ts_send, ts_start);
+  // c->ts_next is when this request was due: if we send late (blocked,
+  // overshooting timer, window full), measuring from send_us only would
+  // hide that delay from latencies (coordinated omission); requests sent
+  // early (--batch-window) are measured from their actual send time, so
+  // latencies from the intended time never go negative
+  sm->intended_us = ts_sub_us(c->ts_next, ts_start);
+  if (sm->intended_us > sm->send_us)
+    sm->intended_us = sm->send_us;
+  hist_add(&w->hist_delay, sm->send_us - sm->intended_us);
+  long late_ns = ts_sub_ns(ts_send, c->ts_next);
+  hist_add(&w->hist_pacing, late_ns > 0 ? late_ns : 0);
+  sm->req_id = pkt_id;
+  sm->conn_id = c->conn_id;
+  sm->sess_id = c->sess_id;
+  bconn_t *b = &c->bc[pick_backend(c)];
+  sm->backend = b->backend;
+  pending_push(b, si);
+  __atomic_fetch_add(&backends[b->backend].outstanding, 1, __ATOMIC_RELAXED);
+
+  /*---- Issue a request to the server ---*/
+  uint32_t len = build_request(c, w->send_buf, pkt_id);
+  unsigned long head = len < BUF_SIZE ? len : BUF_SIZE;
+  trace_ev(TR_SEND_BEGIN, pkt_id, len);
+  int ok = bconn_write(w, b, w->send_buf, head, len - head);
+  trace_ev(TR_SEND_END, pkt_id, 0);
+  c->sess_sent++;
+  stat_add(&w->num_sent, 1);
+
+  if (closed_loop) {
+    // the user whose time came is now waiting for the reply
+    c->ts_ready[conn_first_ready(c)] = c->ts_ready[--c->num_ready];
+    conn_next_ready(c);
+  } else {
+    int epoch = __atomic_load_n(&rate_epoch, __ATOMIC_ACQUIRE);
+    if (c->rate_epoch != epoch) {
+      // new search step: restart the schedule rather than catching up
+      c->rate_epoch = epoch;
+      if (ts_leq(c->ts_next, ts_send))
+        c->ts_next = ts_send;
+    }
+    double period = curr_period_ns();
     unsigned long period_ns;
-    if (exp_arrivals) {
-      period_ns = lround(expon(1.0 / period_us, &rnd_buf) * 1000.0);
+    if (replay_recs != NULL) {
+      // the trace timing, with its average gap when looping over it
+      replay_rec_t *r = &replay_recs[pkt_id % replay_num];
+      if (pkt_id % replay_num + 1 < replay_num)
+        period_ns = r[1].ts_ns - r->ts_ns;
+      else
+        period_ns = replay_num > 1 ? (r->ts_ns - replay_recs[0].ts_ns) / (replay_num - 1) : lround(period);
+    } else if (emp_arrivals.n > 0) {
+      period_ns = lround(emp_sample(&emp_arrivals, &c->rng) * period / emp_arrivals.mean);
+    } else if (exp_arrivals) {
+      period_ns = lround(rng_expon(&c->rng, 1.0 / period));
     } else {
-      period_ns = period_us * 1000;
+      // 1e9 / rate, carrying the remainder: exact on average at any rate
+      unsigned long r = rate, ns = 1000000000UL + c->period_rem;
+      period_ns = ns / r;
+      c->period_rem = ns % r;
     }
     struct timespec ts_delta = (struct timespec) { period_ns / 1000000000, period_ns % 1000000000 };
+    c->ts_next = ts_add(c->ts_next, ts_delta);
+  }
 
-    ts_now = ts_add(ts_now, ts_delta);
+  if (ramp_step_secs != 0) {
+    int step = sm->send_us / 1000000 / ramp_step_secs;
+    int old_rate = rate;
+    if (ramp_fname != NULL)
+      rate = rates[(step < ramp_num_steps) ? step : (ramp_num_steps - 1)];
+    else
+      rate = rate_start + step * ramp_delta_rate;
+    if (old_rate != rate)
+      cw_log("old_rate: %d, rate: %d\n", old_rate, rate);
+  }
 
-    if (wait_spinning) {
-      struct timespec ts;
-      do {
-	clock_gettime(clk_id, &ts);
-      } while (ts_leq(ts, ts_now));
-    } else {
-      sys_check(clock_nanosleep(clk_id, TIMER_ABSTIME, &ts_now, NULL));
+  if (!ok) {
+    conn_end_session(w, c, pkts_per_session - c->sess_recv);
+    return;
+  }
+  if (c->heap_idx >= 0)
+    heap_down(w, c->heap_idx);
+  conn_sched(w, c);
+}
+
+void conn_req_done(worker_info_t *w, conn_info_t *c, struct timespec ts_now);
+
+// Account for the complete reply m, received from b at ts_now
+void conn_reply(worker_info_t *w, bconn_t *b, message_t *m, struct timespec ts_now) {
+  conn_info_t *c = b->c;
+  unsigned long pkt_id = m->req_id;
+  cw_log("Received %u bytes, req_id=%lu, ops=%d\n", m->req_size, pkt_id, m->num);
+  trace_ev(TR_RECV, pkt_id, m->req_size);
+
+  uint64_t si = pending_take(w, b, pkt_id);
+  if (si == NO_SAMPLE) {
+    cw_log("Ignoring late reply to req_id %lu\n", pkt_id);
+    return;
+  }
+  sample_t *sm = samples_get(&w->samples, si);
+  __atomic_fetch_sub(&backends[b->backend].outstanding, 1, __ATOMIC_RELAXED);
+  sm->elapsed_us = ts_sub_us(ts_now, ts_start) - sm->send_us;
+  sm->flags |= SAMPLE_REPLIED;
+  hist_add(&w->hist, sm->elapsed_us > 0 ? sm->elapsed_us : 0);
+  hist_add(&w->backend_hist[b->backend], sm->elapsed_us > 0 ? sm->elapsed_us : 0);
+  hist_add(&w->ival_hist[__atomic_load_n(&w->ival_cur, __ATOMIC_ACQUIRE)], sm->elapsed_us > 0 ? sm->elapsed_us : 0);
+  stat_add(&w->num_replied, 1);
+  hist_add(&w->hist_intended, sm->send_us + sm->elapsed_us - sm->intended_us);
+  w->last_reply_us = sm->send_us + sm->elapsed_us;
+  if (server_timestamps)
+    compute_breakdown(sm, m);
+  cw_log("req_id %lu elapsed %ld us\n", pkt_id, sm->elapsed_us);
+  conn_req_done(w, c, ts_now);
+}
+
+// A request of c got a reply, or timed out
+void conn_req_done(worker_info_t *w, conn_info_t *c, struct timespec ts_now) {
+  if (++c->sess_recv == pkts_per_session) {
+    conn_end_session(w, c, 0);
+    return;
+  }
+
+  if (closed_loop) {
+    // the user thinks before issuing its next request
+    unsigned long think_ns = think_time_us * 1000;
+    if (exp_think && think_time_us > 0)
+      think_ns = lround(rng_expon(&c->rng, 1.0 / think_time_us) * 1000.0);
+    c->ts_ready[c->num_ready++] = ts_add(ts_now, (struct timespec) { think_ns / 1000000000, think_ns % 1000000000 });
+    conn_next_ready(c);
+    if (c->heap_idx >= 0) {
+      heap_down(w, c->heap_idx);
+      heap_up(w, c->heap_idx);
     }
+  }
+  // a window slot or user became available
+  conn_sched(w, c);
+}
 
-    if (ramp_step_secs != 0 && pkt_id > 0) {
-      int step = usecs_send[thread_id][idx(pkt_id)] / 1000000 / ramp_step_secs;
-      int old_rate = rate;
-      if (ramp_fname != NULL)
-        rate = rates[(step < ramp_num_steps) ? step : (ramp_num_steps - 1)];
-      else
-        rate = rate_start + step * ramp_delta_rate;
-      if (old_rate != rate)
-        cw_log("old_rate: %d, rate: %d\n", old_rate, rate);
+// recv() on c without blocking, from its ring with --shm, which is
+// armed to signal the eventfd once found empty
+long bconn_read(bconn_t *c, unsigned char *buf, unsigned long len) {
+  if (c->shm_rx == NULL)
+    return recv(c->sock, buf, len, MSG_DONTWAIT);
+  for (;;) {
+    unsigned long n = shm_ring_read(c->shm_rx, buf, len);
+    if (n > 0) {
+      if (shm_ring_prod_wakeup(c->shm_rx))
+        sys_check(eventfd_write(c->shm_efd_out, 1));
+      return n;
+    }
+    if (shm_ring_cons_wait(c->shm_rx)) {
+      errno = EAGAIN;
+      return -1;
     }
   }
+}
 
-  cw_log("Sender thread terminating\n");
+// Account for all complete replies in c->recv_buf, received at ts_now,
+// moving the partial one left, if any, to its start; returns 0 if one of
+// them ended the session, closing c
+int bconn_parse(worker_info_t *w, bconn_t *c, struct timespec ts_now) {
+  unsigned long off = 0;
+  while (c->recv_len - off >= sizeof(message_t)) {
+    message_t *m = (message_t *) (c->recv_buf + off);
+    unsigned long avail = c->recv_len - off;
+    uint32_t req_size = m->req_size;
+    assert(req_size >= sizeof(message_t));
+    if (avail >= req_size) {
+      conn_reply(w, c, m, ts_now);
+      // a session end resets recv_len
+      if (c->recv_len == 0)
+        return 0;
+      off += req_size;
+      continue;
+    }
+    if (req_size > BUF_SIZE && avail >= BUF_SIZE) {
+      // keep the first BUF_SIZE bytes, receiving the rest over what follows
+      memmove(c->recv_buf, m, BUF_SIZE);
+      c->recv_len = BUF_SIZE;
+      c->recv_skip = req_size - avail;
+      return 1;
+    }
+    // room for the whole reply, or for its first BUF_SIZE bytes and reads beyond
+    unsigned long cap = req_size <= BUF_SIZE ? req_size : BUF_SIZE + RECV_CHUNK;
+    if (cap > c->recv_cap) {
+      memmove(c->recv_buf, m, avail);
+      c->recv_len = avail;
+      off = 0;
+      c->recv_cap = cap;
+      c->recv_buf = realloc(c->recv_buf, c->recv_cap);
+      check(c->recv_buf != NULL);
+    }
+    break;
+  }
+  memmove(c->recv_buf, c->recv_buf + off, c->recv_len - off);
+  c->recv_len -= off;
+  return 1;
+}
 
-  return 0;
+// EPOLLIN: receive replies in chunks of up to recv_cap bytes, and
+// account for all the complete ones after each chunk, with a single
+// receive timestamp; only the first BUF_SIZE bytes of larger replies
+// are kept, the rest being received over the free space past them
+void bconn_recv(worker_info_t *w, bconn_t *c) {
+  while (c->sock != -1) {
+    unsigned long len = c->recv_cap - c->recv_len;
+    if (c->recv_skip > 0 && len > c->recv_skip)
+      len = c->recv_skip;
+    long read = bconn_read(c, c->recv_buf + c->recv_len, len);
+    cw_log("Read %ld bytes\n", read);
+    if (read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (read <= 0) {
+      if (read < 0)
+        perror("recv");
+      conn_end_session(w, c->c, pkts_per_session - c->c->sess_recv);
+      return;
+    }
+    struct timespec ts_now;
+    clock_gettime(clk_id, &ts_now);
+    if (c->recv_skip > 0) {
+      c->recv_skip -= read;
+      if (c->recv_skip > 0)
+        continue;
+      // the large reply at the start of recv_buf is complete
+      c->recv_len = 0;
+      // might end the session, closing c
+      conn_reply(w, c, (message_t *) c->recv_buf, ts_now);
+      continue;
+    }
+    c->recv_len += read;
+    if (!bconn_parse(w, c, ts_now))
+      return;
+  }
+}
+
+// EPOLLIN with UDP: each datagram is a whole reply
+void bconn_recv_dgram(worker_info_t *w, bconn_t *c) {
+  while (c->sock != -1) {
+    long read = recv(c->sock, c->recv_buf, c->recv_cap, MSG_DONTWAIT);
+    cw_log("Read %ld bytes\n", read);
+    if (read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (read < 0) {
+      perror("recv");
+      conn_end_session(w, c->c, pkts_per_session - c->c->sess_recv);
+      return;
+    }
+    message_t *m = (message_t *) c->recv_buf;
+    if (read < sizeof(message_t) || m->req_size != read) {
+      fprintf(stderr, "Malformed datagram of %ld bytes, dropping\n", read);
+      continue;
+    }
+    struct timespec ts_now;
+    clock_gettime(clk_id, &ts_now);
+    // might end the session, closing c
+    conn_reply(w, c, m, ts_now);
+  }
+}
+
+// Event on the eventfd (EPOLLIN) or the socket (EPOLLRDHUP) of a --shm c
+void bconn_shm_event(worker_info_t *w, bconn_t *c, uint32_t events) {
+  if (!(events & EPOLLIN)) {
+    cw_log("Conn %d closed by the node\n", c->c->conn_id);
+    conn_end_session(w, c->c, pkts_per_session - c->c->sess_recv);
+    return;
+  }
+  eventfd_t cnt;
+  eventfd_read(c->shm_efd_in, &cnt);
+  if (c->out_len > 0 || c->out_fill > 0)
+    bconn_flush(w, c);
+  bconn_recv(w, c);
+}
+
+// With UDP, give up on the requests of c not replied to within
+// udp_timeout_us, accounting them as lost
+void conn_expire(worker_info_t *w, conn_info_t *c, struct timespec ts_now) {
+  int64_t now_us = ts_sub_us(ts_now, ts_start);
+  int sess_id = c->sess_id;
+  for (int i = 0; i < num_backends; i++) {
+    bconn_t *b = &c->bc[i];
+    while (b->pending_len > 0) {
+      sample_t *sm = samples_get(&w->samples, b->pending[b->pending_head]);
+      if (sm->send_us + (int64_t) udp_timeout_us > now_us)
+        break;
+      cw_log("req_id %u timed out\n", sm->req_id);
+      pending_pop(b);
+      __atomic_fetch_sub(&backends[i].outstanding, 1, __ATOMIC_RELAXED);
+      stat_add(&w->num_timeouts, 1);
+      stat_add(&w->num_lost, 1);
+      conn_req_done(w, c, ts_now);
+      // the session might be over
+      if (c->sess_id != sess_id)
+        return;
+    }
+  }
+}
+
+// --wait-hybrid: the timer set for ts_timer woke us up, move the slack
+// towards the 95th percentile of wake-up latencies, up by 1/8 if it was
+// exceeded, down by 1/(8*19) otherwise (it settles where 1 in 20 are
+// exceeded); these bounded steps keep rare outliers, e.g., preemptions,
+// from inflating it
+void worker_timer_woke(worker_info_t *w, struct timespec ts_timer) {
+  struct timespec ts_now;
+  clock_gettime(clk_id, &ts_now);
+  long lat_ns = ts_sub_ns(ts_now, ts_timer);
+  if (lat_ns < 0)
+    lat_ns = 0;
+  hist_add(&w->hist_wake, lat_ns);
+  if (lat_ns > w->slack_ns)
+    w->slack_ns += w->slack_ns / 8;
+  else
+    w->slack_ns -= w->slack_ns / (8 * 19);
+  if (w->slack_ns < WAIT_SLACK_MIN_NS)
+    w->slack_ns = WAIT_SLACK_MIN_NS;
+  if (w->slack_ns > WAIT_SLACK_MAX_NS)
+    w->slack_ns = WAIT_SLACK_MAX_NS;
+}
+
+// Send the requests due by ts_now, or within batch_window_ns of it, in
+// rounds of up to SEND_BATCH: within a round, requests are appended to
+// the output of their bconn, and each bconn sends its own at the end of
+// the round with a single syscall, so that a worker falling behind, or
+// sending over few conns at millions of req/s, does not pay one syscall
+// per request; each sample still records the time its request was due
+void worker_send_due(worker_info_t *w, struct timespec ts_now) {
+  struct timespec ts_due = ts_add(ts_now, (struct timespec) { batch_window_ns / 1000000000, batch_window_ns % 1000000000 });
+  while (w->heap_size > 0 && ts_leq(w->heap[0]->ts_next, ts_due)) {
+    w->batching = 1;
+    for (int n = 0; n < SEND_BATCH && w->heap_size > 0 && ts_leq(w->heap[0]->ts_next, ts_due); n++)
+      conn_send_request(w, w->heap[0]);
+    w->batching = 0;
+    for (int i = 0; i < w->batch_size; i++) {
+      bconn_t *b = w->batch[i];
+      // none left if sent before filler, or if the session ended
+      if (b->out_batch > 0 && !bconn_send_batch(w, b))
+        conn_end_session(w, b->c, pkts_per_session - b->c->sess_recv);
+    }
+    w->batch_size = 0;
+  }
 }
 
-void *thread_receiver(void *data) {
-  int thread_id = (int)(unsigned long) data;
-  unsigned char *recv_buf = malloc(BUF_SIZE);
-  check(recv_buf != NULL);
-
-  for (int i = 0; i < num_pkts; i++) {
-    if (i % pkts_per_session == 0) {
-      /*---- Create the socket. The three arguments are: ----*/
-      /* 1) Internet domain 2) Stream socket 3) Default protocol (TCP in this case) */
-      clientSocket[thread_id] = socket(PF_INET, SOCK_STREAM, 0);
-
-      sys_check(setsockopt(clientSocket[thread_id], IPPROTO_TCP, TCP_NODELAY, (void *)&no_delay, sizeof(no_delay)));
-
-      cw_log("Binding to %s:%d\n", inet_ntoa(myaddr.sin_addr), myaddr.sin_port);
-
-      /*---- Bind the address struct to the socket ----*/
-      sys_check(bind(clientSocket[thread_id], (struct sockaddr *) &myaddr, sizeof(myaddr)));
-
-      /*---- Connect the socket to the server using the address struct ----*/
-      addr_size = sizeof(serveraddr);
-
-      cw_log("Connecting (i=%d) ...\n", i);
-      sys_check(connect(clientSocket[thread_id], (struct sockaddr *) &serveraddr, addr_size));
-      /* spawn sender once connection is established */
-      thread_data_t thr_data = {
-        .thread_id = thread_id,
-        .first_pkt_id = i,
-        .num_send_pkts = pkts_per_session
-      };
-      assert(pthread_create(&sender[thread_id], NULL, thread_sender, (void*)&thr_data) == 0);
-    }
-
-    /*---- Read the message from the server into the buffer ----*/
-    // TODO: support receive of variable reply-size requests
-    cw_log("Receiving %lu bytes (header)\n", sizeof(message_t));
-    unsigned long read = safe_recv(clientSocket[thread_id], recv_buf, sizeof(message_t));
-    if (read != sizeof(message_t)) {
-      printf("ERROR: read %lu bytes while expecting %lu! Forcing premature end of session!\n", read, sizeof(message_t));
-      unsigned long skip_pkts = pkts_per_session - ((i + 1) % pkts_per_session);
-      printf("Fast-forwarding i by %lu pkts\n", skip_pkts);
-      i += skip_pkts;
-      goto skip;
-    }
-    message_t *m = (message_t *) recv_buf;
-    unsigned long pkt_id = m->req_id;
-    cw_log("Received %lu bytes, req_id=%lu, pkt_size=%u, ops=%d\n",
-	   read, pkt_id, m->req_size, m->num);
-    cw_log("Expecting further %lu bytes (total pkt_size %u bytes)\n",
-	   m->req_size - read, m->req_size);
-    assert(m->req_size >= sizeof(message_t));
-    safe_recv(clientSocket[thread_id], recv_buf + read, m->req_size - read);
+void *thread_worker(void *data) {
+  worker_info_t *w = (worker_info_t *) data;
+  struct epoll_event events[MAX_EVENTS];
+
+  trace_thread_init(w->worker_id);
+
+  w->send_buf = malloc(BUF_SIZE);
+  check(w->send_buf != NULL);
+  w->heap = malloc(w->num_conns * sizeof(w->heap[0]));
+  check(w->heap != NULL);
+  w->heap_size = 0;
+  w->batch = malloc(SEND_BATCH * sizeof(w->batch[0]));
+  check(w->batch != NULL);
+  w->batch_size = 0;
+  sys_check(w->epollfd = epoll_create1(0));
+  sys_check(w->timerfd = timerfd_create(clk_id, 0));
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  sys_check(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev));
+  w->ts_timer = (struct timespec) { 0, 0 };
+  w->slack_ns = wait_slack_ns;
+  struct timespec ts_spin = { 0, 0 };	// start of the current hybrid spin
+
+  w->active = w->num_conns;
+  for (int i = 0; i < w->num_conns; i++) {
+    conn_info_t *c = &w->conns[i];
+    rng_seed(&c->rng, time(NULL) + c->conn_id);
+    if (closed_loop) {
+      c->ts_ready = malloc(closed_loop * sizeof(c->ts_ready[0]));
+      check(c->ts_ready != NULL);
+    }
+    c->bc = calloc(num_backends, sizeof(c->bc[0]));
+    check(c->bc != NULL);
+    for (int j = 0; j < num_backends; j++) {
+      bconn_t *b = &c->bc[j];
+      b->c = c;
+      b->backend = j;
+      b->sock = -1;
+      // grown on demand for replies larger than RECV_CHUNK, a whole datagram with UDP
+      b->recv_cap = udp ? UDP_MAX_SIZE : RECV_CHUNK;
+      b->recv_buf = malloc(b->recv_cap);
+      check(b->recv_buf != NULL);
+    }
+    conn_connect(w, c);
+  }
 
+  while (w->active > 0 && !__atomic_load_n(&stop_sending, __ATOMIC_RELAXED)) {
     struct timespec ts_now;
     clock_gettime(clk_id, &ts_now);
-    unsigned long usecs = (ts_now.tv_sec - ts_start.tv_sec) * 1000000
-      + (ts_now.tv_nsec - ts_start.tv_nsec) / 1000;
-    usecs_elapsed[thread_id][idx(pkt_id)] = usecs - usecs_send[thread_id][idx(pkt_id)];
-    cw_log("req_id %lu elapsed %ld us\n", pkt_id, usecs_elapsed[thread_id][idx(pkt_id)]);
-
-    skip:
-    if ((i+1) % pkts_per_session == 0) {
-      cw_log("Session is over (after receive of pkt %d), closing socket\n", i);
-      close(clientSocket[thread_id]);
-      if (per_session_output) {
-        int first_sess_pkt = i - (pkts_per_session - 1);
-        int sess_id = i / pkts_per_session;
-        for (int j = 0; j < pkts_per_session; j++) {
-          int pkt_id = first_sess_pkt + j;
-          printf("t: %ld us, elapsed: %ld us, req_id: %d, thr_id: %d, sess_id: %d\n", usecs_send[thread_id][idx(pkt_id)], usecs_elapsed[thread_id][idx(pkt_id)], pkt_id, thread_id, sess_id);
+    if (ts_spin.tv_sec != 0) {
+      w->spin_ns += ts_sub_ns(ts_now, ts_spin);
+      ts_spin = (struct timespec) { 0, 0 };
+    }
+    int paused = __atomic_load_n(&send_paused, __ATOMIC_RELAXED);
+    if (!paused)
+      worker_send_due(w, ts_now);
+
+    int timeout = -1;
+    if (udp) {
+      // check for timed-out requests every udp_timeout_us / 4
+      long check_ms = udp_timeout_us / 4000 > 0 ? udp_timeout_us / 4000 : 1;
+      if (!ts_leq(ts_now, w->ts_expire)) {
+        for (int i = 0; i < w->num_conns; i++)
+          conn_expire(w, &w->conns[i], ts_now);
+        w->ts_expire = ts_add(ts_now, (struct timespec) { check_ms / 1000, check_ms % 1000 * 1000000 });
+      }
+      timeout = ts_sub_us(w->ts_expire, ts_now) / 1000 + 1;
+    }
+    if (paused) {
+      // poll for the pause to end
+      timeout = 1;
+    } else if (w->heap_size > 0) {
+      struct timespec ts_next = w->heap[0]->ts_next;
+      if (wait_hybrid)
+        ts_next = ts_sub(ts_next, (struct timespec) { 0, w->slack_ns });
+      if (wait_spinning) {
+        timeout = 0;
+      } else if (wait_hybrid && ts_leq(ts_next, ts_now)) {
+        // within the slack: poll replies while spinning till the send time
+        timeout = 0;
+        ts_spin = ts_now;
+      } else if (ts_next.tv_sec != w->ts_timer.tv_sec || ts_next.tv_nsec != w->ts_timer.tv_nsec) {
+        struct itimerspec its = { .it_interval = { 0, 0 }, .it_value = ts_next };
+        sys_check(timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL));
+        w->ts_timer = ts_next;
+      }
+    }
+
+    int nfds = epoll_wait(w->epollfd, events, MAX_EVENTS, timeout);
+    if (nfds < 0 && errno == EINTR)
+      continue;
+    sys_check(nfds);
+    for (int i = 0; i < nfds; i++) {
+      bconn_t *c = events[i].data.ptr;
+      if (c == NULL) {
+        uint64_t expirations;
+        if (read(w->timerfd, &expirations, sizeof(expirations)) > 0) {
+          if (wait_hybrid)
+            worker_timer_woke(w, w->ts_timer);
+          w->ts_timer = (struct timespec) { 0, 0 };
         }
+        continue;
+      }
+      // skip stale events for conns closed meanwhile
+      if (c->sock == -1)
+        continue;
+      if (c->connecting) {
+        bconn_connected(w, c);
+        continue;
+      }
+      if (c->shm_rx != NULL) {
+        bconn_shm_event(w, c, events[i].events);
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && !bconn_flush(w, c)) {
+        conn_end_session(w, c->c, pkts_per_session - c->c->sess_recv);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if (udp)
+          bconn_recv_dgram(w, c);
+        else
+          bconn_recv(w, c);
       }
-      cw_log("Joining sender thread\n");
-      pthread_join(sender[thread_id], NULL);
     }
   }
 
-  if (!per_session_output) {
-    for (int i = 0; i < num_pkts; i++) {
-      int sess_id = i / pkts_per_session;
-      printf("t: %ld us, elapsed: %ld us, req_id: %d, thr_id: %d, sess_id: %d\n", usecs_send[thread_id][i], usecs_elapsed[thread_id][idx(i)], i, thread_id, sess_id);
+  for (int i = 0; i < w->num_conns; i++) {
+    for (int j = 0; j < num_backends; j++) {
+      bconn_t *b = &w->conns[i].bc[j];
+      if (b->sock != -1)
+        bconn_close(w, b);
+      free(b->recv_buf);
+      free(b->out_buf);
+      free(b->pending);
     }
+    free(w->conns[i].bc);
+    free(w->conns[i].ts_ready);
   }
+  close(w->timerfd);
+  close(w->epollfd);
+  free(w->heap);
+  free(w->batch);
+  free(w->send_buf);
+  cw_log("Worker thread terminating\n");
+  return 0;
+}
+
+void sigusr1_trace_dump(int _) {
+  (void)_;
+  trace_dump();
+}
+
+void sigint_trace_dump(int sig) {
+  trace_dump();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
 
-  cw_log("Receiver thread terminating\n");
+// Every report_interval secs, print the send and reply rates, the
+// number of in-flight requests and the percentiles of the elapsed
+// times in the interval. Workers add to one of their two interval
+// histograms, which the reporter swaps, then merges the one swapped out.
+// That one is only cleared right before being swapped in again, one
+// interval later, so workers still adding to it right after the swap
+// (having loaded ival_cur just before) can only delay a sample to the
+// next interval, never corrupt it.
+void *thread_reporter(void *data) {
+  static hist_t h;
+  uint64_t prev_sent = 0, prev_replied = 0;
+  struct timespec ts_prev = ts_start, ts_next = ts_start;
+  long ival_ns = report_interval * 1e9;
+  struct timespec ts_ival = { ival_ns / 1000000000, ival_ns % 1000000000 };
+
+  pthread_mutex_lock(&reporter_mtx);
+  while (!workers_done) {
+    ts_next = ts_add(ts_next, ts_ival);
+    if (pthread_cond_timedwait(&reporter_cond, &reporter_mtx, &ts_next) != ETIMEDOUT)
+      continue;
+
+    uint64_t sent = 0, replied = 0, lost = 0;
+    hist_reset(&h);
+    for (int w = 0; w < num_workers; w++) {
+      worker_info_t *wi = &workers[w];
+      int cur = wi->ival_cur;
+      hist_reset(&wi->ival_hist[1 - cur]);
+      __atomic_store_n(&wi->ival_cur, 1 - cur, __ATOMIC_RELEASE);
+      hist_merge(&h, &wi->ival_hist[cur]);
+      sent += __atomic_load_n(&wi->num_sent, __ATOMIC_RELAXED);
+      replied += __atomic_load_n(&wi->num_replied, __ATOMIC_RELAXED);
+      lost += __atomic_load_n(&wi->num_lost, __ATOMIC_RELAXED);
+    }
+    struct timespec ts_now;
+    clock_gettime(clk_id, &ts_now);
+    double secs = ts_sub_us(ts_now, ts_prev) / 1e6;
+    printf("interval: t: %.3f s, send_rate: %.1f req/s, reply_rate: %.1f req/s, in_flight: %lu, p50: %lu us, p90: %lu us, p99: %lu us, p99.9: %lu us, max: %lu us\n",
+           ts_sub_us(ts_now, ts_start) / 1e6, (sent - prev_sent) / secs, (replied - prev_replied) / secs,
+           sent - replied - lost, hist_percentile(&h, 50), hist_percentile(&h, 90),
+           hist_percentile(&h, 99), hist_percentile(&h, 99.9), hist_max(&h));
+    fflush(stdout);
+    prev_sent = sent;
+    prev_replied = replied;
+    ts_prev = ts_now;
+  }
+  pthread_mutex_unlock(&reporter_mtx);
   return 0;
 }
 
+// Sum of the elapsed times from intended send times, and of the replies, of all workers
+void search_snapshot(hist_t *h, uint64_t *replied) {
+  hist_reset(h);
+  *replied = 0;
+  for (int w = 0; w < num_workers; w++) {
+    hist_merge(h, &workers[w].hist_intended);
+    *replied += __atomic_load_n(&workers[w].num_replied, __ATOMIC_RELAXED);
+  }
+}
+
+#define SEARCH_DRAIN_SECS 10
+
+// Hold sends till in-flight requests are replied (for at most
+// SEARCH_DRAIN_SECS), so as not to carry queues over to the next step
+void search_drain() {
+  __atomic_store_n(&send_paused, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < SEARCH_DRAIN_SECS * 1000; i++) {
+    uint64_t in_flight = 0;
+    for (int w = 0; w < num_workers; w++)
+      in_flight += __atomic_load_n(&workers[w].num_sent, __ATOMIC_RELAXED)
+        - __atomic_load_n(&workers[w].num_replied, __ATOMIC_RELAXED)
+        - __atomic_load_n(&workers[w].num_lost, __ATOMIC_RELAXED);
+    if (in_flight == 0)
+      return;
+    usleep(1000);
+  }
+}
+
+// Send at r req/s per conn, returning whether the SLO was met
+// over the measurement window, after the warm-up one
+int search_step(unsigned int r) {
+  static hist_t h_beg, h_end;
+  uint64_t replied_beg, replied_end;
+  struct timespec ts, ts_beg, ts_end;
+  long warmup_ns = search_warmup_secs * 1e9;
+  long measure_ns = search_secs * 1e9;
+
+  // like ramp steps, just change the rate the workers send at
+  __atomic_store_n(&rate, r, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&rate_epoch, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&send_paused, 0, __ATOMIC_RELAXED);
+
+  clock_gettime(clk_id, &ts);
+  ts = ts_add(ts, (struct timespec) { warmup_ns / 1000000000, warmup_ns % 1000000000 });
+  clock_nanosleep(clk_id, TIMER_ABSTIME, &ts, NULL);
+  clock_gettime(clk_id, &ts_beg);
+  search_snapshot(&h_beg, &replied_beg);
+
+  ts = ts_add(ts_beg, (struct timespec) { measure_ns / 1000000000, measure_ns % 1000000000 });
+  clock_nanosleep(clk_id, TIMER_ABSTIME, &ts, NULL);
+  clock_gettime(clk_id, &ts_end);
+  search_snapshot(&h_end, &replied_end);
+
+  hist_sub(&h_end, &h_beg);
+  double secs = ts_sub_us(ts_end, ts_beg) / 1e6;
+  uint64_t perc_us = hist_percentile(&h_end, slo_perc);
+  // a step with no replies at all cannot have met the SLO
+  int met = h_end.count > 0 && perc_us < slo_us;
+  printf("search_step: rate: %u req/s, total_rate: %lu req/s, throughput: %.1f req/s, p50: %lu us, p%g: %lu us, slo: %s\n",
+         r, (unsigned long) r * num_conns, (replied_end - replied_beg) / secs,
+         hist_percentile(&h_end, 50), slo_perc, perc_us, met ? "met" : "violated");
+  fflush(stdout);
+  search_drain();
+  return met;
+}
+
+// Double the rate until the SLO is violated, then bisect between the
+// highest rate meeting it and the lowest one violating it
+void search_rate() {
+  unsigned int lo = 0, hi = 0, r = rate;
+  if (search_precision == 0)
+    search_precision = rate / 100 > 0 ? rate / 100 : 1;
+  while (1) {
+    if (search_step(r))
+      lo = r;
+    else
+      hi = r;
+    if (hi == 0) {
+      if (r >= search_max_rate)
+        break;
+      r = (2 * r < search_max_rate) ? 2 * r : search_max_rate;
+    } else {
+      if (hi - lo <= search_precision)
+        break;
+      r = (lo + hi) / 2;
+    }
+  }
+  printf("search_result: max_rate: %u req/s, total_rate: %lu req/s, slo: p%g < %lu us\n",
+         lo, (unsigned long) lo * num_conns, slo_perc, slo_us);
+  __atomic_store_n(&stop_sending, 1, __ATOMIC_RELAXED);
+}
+
+// Merge the histograms of all workers, printing a one-line summary
+void print_hist_unit(const char *name, hist_t *h, const char *u) {
+  printf("%s: count: %lu, mean: %lu %s, min: %lu %s, p50: %lu %s, p90: %lu %s, p99: %lu %s, p99.9: %lu %s, p99.99: %lu %s, max: %lu %s",
+         name, h->count, hist_mean(h), u, hist_min(h), u,
+         hist_percentile(h, 50), u, hist_percentile(h, 90), u, hist_percentile(h, 99), u,
+         hist_percentile(h, 99.9), u, hist_percentile(h, 99.99), u, hist_max(h), u);
+}
+
+void print_hist(const char *name, hist_t *h) {
+  print_hist_unit(name, h, "us");
+}
+
+// Samples sent within [measure_from_us, measure_to_us), and that are not
+// among the first warmup_pkts or last cooldown_pkts of their session, are
+// the ones accounted for in the summary
+int sample_measured(sample_t *sm) {
+  // index within the session, req_id being the low 32 bits of pkt_id
+  uint32_t idx = sm->req_id - (uint32_t) (sm->sess_id * pkts_per_session);
+  return sm->send_us >= measure_from_us && sm->send_us < measure_to_us
+    && idx >= warmup_pkts && idx + cooldown_pkts < pkts_per_session;
+}
+
+int measure_all() {
+  return warmup_secs == 0 && cooldown_secs == 0 && warmup_pkts == 0 && cooldown_pkts == 0 && !steady_state;
+}
+
+// Split the run into windows of steady_window_secs (on send times),
+// returning the start of the first STEADY_WINDOWS consecutive windows
+// whose mean elapsed times (from intended send times) are all within
+// steady_tol (relative) of their overall mean, or -1 if there are none
+int64_t steady_state_start(int64_t last_send_us) {
+  int64_t window_us = steady_window_secs * 1e6;
+  int num_windows = last_send_us / window_us + 1;
+  double *sum = calloc(num_windows, sizeof(double));
+  uint64_t *cnt = calloc(num_windows, sizeof(uint64_t));
+  check(sum != NULL && cnt != NULL);
+  for (int w = 0; w < num_workers; w++) {
+    samples_t *smp = &workers[w].samples;
+    for (uint64_t i = 0; i < samples_num(smp); i++) {
+      sample_t *sm = samples_get(smp, i);
+      if (!sample_measured(sm) || !(sm->flags & SAMPLE_REPLIED))
+        continue;
+      sum[sm->send_us / window_us] += sm->send_us + sm->elapsed_us - sm->intended_us;
+      cnt[sm->send_us / window_us]++;
+    }
+  }
+  int64_t start_us = -1;
+  for (int k = 0; k + STEADY_WINDOWS <= num_windows && start_us < 0; k++) {
+    double mean = 0;
+    int j;
+    for (j = k; j < k + STEADY_WINDOWS && cnt[j] > 0; j++)
+      mean += sum[j] / cnt[j] / STEADY_WINDOWS;
+    if (j < k + STEADY_WINDOWS)
+      continue;
+    for (j = k; j < k + STEADY_WINDOWS; j++)
+      if (fabs(sum[j] / cnt[j] - mean) > steady_tol * mean)
+        break;
+    if (j == k + STEADY_WINDOWS)
+      start_us = k * window_us;
+  }
+  free(sum);
+  free(cnt);
+  return start_us;
+}
+
+// Restrict the measured window as requested by the warm-up/cool-down
+// options, and to the steady state if detected
+void set_measured_window() {
+  int64_t last_send_us = 0;
+  for (int w = 0; w < num_workers; w++) {
+    samples_t *smp = &workers[w].samples;
+    for (uint64_t i = 0; i < samples_num(smp); i++)
+      if (samples_get(smp, i)->send_us > last_send_us)
+        last_send_us = samples_get(smp, i)->send_us;
+  }
+  measure_from_us = warmup_secs * 1e6;
+  measure_to_us = last_send_us + 1 - (int64_t) (cooldown_secs * 1e6);
+  if (steady_state) {
+    int64_t start_us = steady_state_start(last_send_us);
+    if (start_us < 0) {
+      printf("steady_state: not detected\n");
+    } else {
+      printf("steady_state: from: %.3f s\n", start_us / 1e6);
+      if (start_us > measure_from_us)
+        measure_from_us = start_us;
+    }
+  }
+  printf("measured: from: %.3f s, to: %.3f s, skipping first %lu and last %lu pkts of each session\n",
+         measure_from_us / 1e6, measure_to_us / 1e6, warmup_pkts, cooldown_pkts);
+}
+
+// Besides elapsed times from the actual send times, print them from
+// the intended send times, and how late requests were sent
+void print_summary() {
+  static hist_t h, h_intended, h_delay;
+  hist_t *h_backend = calloc(num_backends, sizeof(hist_t));
+  uint64_t *sent_backend = calloc(num_backends, sizeof(uint64_t));
+  uint64_t sent = 0;
+  int64_t first_send_us = 0, last_reply_us = 0;
+  check(h_backend != NULL && sent_backend != NULL);
+  hist_reset(&h);
+  hist_reset(&h_intended);
+  hist_reset(&h_delay);
+  if (!measure_all()) {
+    // rebuild the histograms from the samples in the measured window
+    first_send_us = INT64_MAX;
+    for (int w = 0; w < num_workers; w++) {
+      samples_t *smp = &workers[w].samples;
+      for (uint64_t i = 0; i < samples_num(smp); i++) {
+        sample_t *sm = samples_get(smp, i);
+        if (!sample_measured(sm))
+          continue;
+        sent++;
+        sent_backend[sm->backend]++;
+        if (sm->send_us < first_send_us)
+          first_send_us = sm->send_us;
+        hist_add(&h_delay, sm->send_us > sm->intended_us ? sm->send_us - sm->intended_us : 0);
+        if (!(sm->flags & SAMPLE_REPLIED))
+          continue;
+        hist_add(&h, sm->elapsed_us > 0 ? sm->elapsed_us : 0);
+        hist_add(&h_backend[sm->backend], sm->elapsed_us > 0 ? sm->elapsed_us : 0);
+        hist_add(&h_intended, sm->send_us + sm->elapsed_us - sm->intended_us);
+        if (sm->send_us + sm->elapsed_us > last_reply_us)
+          last_reply_us = sm->send_us + sm->elapsed_us;
+      }
+    }
+    if (sent == 0)
+      first_send_us = 0;
+  } else {
+    for (int w = 0; w < num_workers; w++) {
+      hist_merge(&h, &workers[w].hist);
+      hist_merge(&h_intended, &workers[w].hist_intended);
+      hist_merge(&h_delay, &workers[w].hist_delay);
+      sent += samples_num(&workers[w].samples);
+      for (int b = 0; b < num_backends; b++)
+        hist_merge(&h_backend[b], &workers[w].backend_hist[b]);
+      if (num_backends > 1)
+        for (uint64_t i = 0; i < samples_num(&workers[w].samples); i++)
+          sent_backend[samples_get(&workers[w].samples, i)->backend]++;
+      if (workers[w].last_reply_us > last_reply_us)
+        last_reply_us = workers[w].last_reply_us;
+    }
+  }
+  double secs = (last_reply_us - first_send_us) / 1e6;
+  print_hist("summary", &h);
+  printf(", lost: %lu, duration: %.3f s, throughput: %.1f req/s\n",
+         sent - h.count, secs, secs > 0 ? h.count / secs : 0.0);
+  print_hist("summary_intended", &h_intended);
+  printf("\n");
+  print_hist("send_delay", &h_delay);
+  printf("\n");
+  // how precisely the send schedule is met, over the whole run
+  static hist_t h_pacing, h_wake;
+  uint64_t spin_ns = 0;
+  long slack_ns = 0;
+  hist_reset(&h_pacing);
+  hist_reset(&h_wake);
+  for (int w = 0; w < num_workers; w++) {
+    hist_merge(&h_pacing, &workers[w].hist_pacing);
+    hist_merge(&h_wake, &workers[w].hist_wake);
+    spin_ns += workers[w].spin_ns;
+    slack_ns += workers[w].slack_ns;
+  }
+  print_hist_unit("pacing_error", &h_pacing, "ns");
+  printf("\n");
+  if (wait_hybrid) {
+    print_hist_unit("timer_wakeup", &h_wake, "ns");
+    printf(", slack: %ld ns, spin: %.3f s\n", slack_ns / num_workers, spin_ns / 1e9);
+  }
+  if (udp) {
+    uint64_t timeouts = 0, reordered = 0, late = 0;
+    for (int w = 0; w < num_workers; w++) {
+      timeouts += workers[w].num_timeouts;
+      reordered += workers[w].num_reordered;
+      late += workers[w].num_late;
+    }
+    printf("udp: timeouts: %lu, reordered: %lu, late: %lu\n", timeouts, reordered, late);
+  }
+  if (num_backends > 1) {
+    for (int b = 0; b < num_backends; b++) {
+      char name[128];
+      snprintf(name, sizeof(name), "backend %s:%d", backends[b].host, backends[b].port);
+      print_hist(name, &h_backend[b]);
+      printf(", lost: %lu, share: %.1f%%\n", sent_backend[b] - h_backend[b].count,
+             sent > 0 ? 100.0 * sent_backend[b] / sent : 0.0);
+    }
+  }
+  free(h_backend);
+  free(sent_backend);
+}
+
+// Query node statistics of backend b over a dedicated connection,
+// printing them unless only a reset is requested
+void node_stats_query(int b, uint32_t flags, int print) {
+  unsigned char buf[sizeof(message_t) + sizeof(node_stats_t)];
+  message_t *m = (message_t *) buf;
+  int sock;
+
+  sys_check(sock = socket(PF_INET, SOCK_STREAM, 0));
+  sys_check(connect(sock, (struct sockaddr *) &backends[b].addr, sizeof(backends[b].addr)));
+
+  m->req_id = 0;
+  m->flags = 0;
+  m->req_size = MIN_SEND_SIZE;
+  m->num = 2;
+  m->cmds[0].cmd = STATS;
+  m->cmds[0].u.stats_flags = flags;
+  m->cmds[1].cmd = REPLY;
+  m->cmds[1].u.fwd.pkt_size = sizeof(buf);
+  safe_send(sock, buf, m->req_size);
+
+  check(safe_recv(sock, buf, sizeof(message_t)) == sizeof(message_t));
+  check(m->req_size == sizeof(buf));
+  check(safe_recv(sock, buf + sizeof(message_t), m->req_size - sizeof(message_t)) == m->req_size - sizeof(message_t));
+  close(sock);
+
+  if (!print)
+    return;
+  node_stats_t ns;
+  memcpy(&ns, buf + sizeof(message_t), sizeof(ns));
+  if (num_backends > 1)
+    printf("node_stats: backend: %s:%d\n", backends[b].host, backends[b].port);
+  printf("node_stats: elapsed: %.3f s\n", ns.elapsed_ns / 1e9);
+  for (int s = 0; s < STAT_NUM; s++) {
+    stat_summary_t *st = &ns.stats[s];
+    printf("node_stats: %s count: %lu, mean: %.3f us, min: %.3f us, p50: %.3f us, p90: %.3f us, p99: %.3f us, p99.9: %.3f us, max: %.3f us\n",
+           get_stat_name(s), st->count, st->mean_ns / 1e3, st->min_ns / 1e3, st->p50_ns / 1e3,
+           st->p90_ns / 1e3, st->p99_ns / 1e3, st->p999_ns / 1e3, st->max_ns / 1e3);
+  }
+  perf_stats_t *p = &ns.perf;
+  if (p->avail_mask != 0) {
+    printf("node_perf: samples: %lu, preempted: %lu, migrated: %lu", p->samples, p->preempted, p->migrated);
+    for (int i = 0; i < PC_NUM; i++)
+      if (p->avail_mask & (1 << i))
+        printf(", %s/req: %.1f", get_perf_counter_name(i, p->sw_mask & (1 << i)),
+               p->samples > 0 ? (double) p->sum[i] / p->samples : 0.0);
+    printf("\n");
+  }
+  // times are only measured with --busy-poll, to keep clock reads off the default path
+  poll_stats_t *ps = &ns.poll;
+  if (ps->spin_ns > 0 || ps->sleep_ns > 0)
+    printf("node_poll: spin: %.3f s, sleep: %.3f s, sleeps: %lu, spin share: %.1f%%\n",
+           ps->spin_ns / 1e9, ps->sleep_ns / 1e9, ps->sleeps,
+           100.0 * ps->spin_ns / (ps->spin_ns + ps->sleep_ns));
+}
+
 int main(int argc, char *argv[]) {
   check(signal(SIGTERM, SIG_IGN) != SIG_ERR);
 
   argc--;  argv++;
   while (argc > 0) {
     if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
-      printf("Usage: dw_client [-h|--help] [-b bindname] [-bp bindport] [-sn servername] [-sb serverport] [-n num_pkts] [-c num_compute] [-s num_store] [-l num_load] [-p period(us)] [-r|--rate rate] [-ea|--exp-arrivals] [-ws|--wait-spin] [-rss|--ramp-step-secs secs] [-rdr|--ramp-delta-rate r] [-rns|--ramp-num-steps n] [-rfn|--rate-file-name rates_file.dat] [-C|--comp-time comp_time(us)] [-ec|--exp-comp] [-S|--store-data n(bytes)] [-L|--load-data n(bytes)] [-Cw|--comp-weight w] [-Sw|--store-weight w] [-Lw|--load-weight w] [-ps req_size] [-eps|--exp-req-size] [-rs resp_size] [-ers|--exp-resp-size] [-nd|--no-delay val] [-nt|--num-threads threads] [-ns|--num-sessions] [-pso|--per-session-output]\n"
+      printf("Usage: dw_client [-h|--help] [-b bindname] [-bp bindport] [-sn servername] [-sb serverport] [--servers host:port[,host:port...]] [-lb|--lb-policy rr|random|p2c|hash] [--hash-keys n] [-n num_pkts] [-c num_compute] [-s num_store] [-l num_load] [-p period(us)] [-r|--rate rate] [-ea|--exp-arrivals] [--emp-arrivals file] [--replay trace.bin] [-ws|--wait-spin] [-wh|--wait-hybrid] [--wait-slack us] [--batch-window us] [-cl|--closed-loop users] [-tt|--think-time time(us)] [-et|--exp-think] [-mif|--max-in-flight n] [-rss|--ramp-step-secs secs] [-rdr|--ramp-delta-rate r] [-rns|--ramp-num-steps n] [-rfn|--rate-file-name rates_file.dat] [-C|--comp-time comp_time(us)] [-ec|--exp-comp] [--emp-comp file] [-S|--store-data n(bytes)] [-L|--load-data n(bytes)] [-Cw|--comp-weight w] [-Sw|--store-weight w] [-Lw|--load-weight w] [-ps req_size] [-eps|--exp-req-size] [--emp-req-size file] [-rs resp_size] [-ers|--exp-resp-size] [--emp-resp-size file] [-nd|--no-delay val] [--tcp-fastopen] [--udp] [--udp-timeout us] [--unix path] [--shm path] [--shm-size bytes] [-nt|--num-threads threads] [-nc|--connections conns] [-nw|--workers workers] [-ns|--num-sessions] [-pso|--per-session-output] [-nso|--no-samples-output] [-ri|--report-interval secs] [--slo pP:us] [--search-warmup secs] [--search-secs secs] [--search-precision rate] [--search-max-rate rate] [--warmup-secs secs] [--warmup-pkts n] [--cooldown-secs secs] [--cooldown-pkts n] [--steady-state] [--steady-window secs] [--steady-tol frac] [-sts|--server-timestamps] [--node-stats] [--node-stats-reset] [--samples prefix] [--trace trace.bin] [--trace-size events]\n"
              "\n"
              "Options:\n"
              "  -h|--help ....................... This help message\n"
              "  -b .............................. Client-side bind name/IP (defaults to 0.0.0.0)\n"
              "  -bp ............................. Client-side bind port\n"
              "  -sn ............................. Server name or IP (defaults to 127.0.0.1)\n"
-             "  -n num_pkts ..................... Set number of packets sent by each thread (across all sessions)\n"
+             "  --servers host:port,... ......... Balance requests across multiple server nodes (port defaults to -sp)\n"
+             "  -lb|--lb-policy policy .......... How to pick the server of each request: rr, random, p2c (less loaded of 2 random ones), hash (consistent hashing of request keys)\n"
+             "  --hash-keys n ................... Number of distinct request keys with -lb hash (defaults to 1000)\n"
+             "  -n num_pkts ..................... Set number of packets sent over each connection (across all sessions)\n"
              "  -c num_compute .................. Set number of compute operations\n"
              "  -s num_store .................... Set number of store operations to disk\n"
              "  -l num_load ..................... Set number of load operations from disk\n"
-             "  -p period(us) ................... Set inter-send period for each thread (average, if -ea is specified)\n"
-             "  -r rate ......................... Set sending rate for each rate (average, if -ea is specified)\n"
+             "  -p period(us) ................... Set inter-send period for each connection (average, if -ea is specified)\n"
+             "  -r rate ......................... Set sending rate for each connection (average, if -ea is specified)\n"
              "  -ws|--wait-spin ................. Spin-wait instead of sleeping till next sending time\n"
-             "  -ea|--exp-arrivals .............. Set exponentially distributed inter-send times for each thread\n"
+             "  -wh|--wait-hybrid ............... Sleep till shortly before next sending time, then spin, adapting how early to timer wake-up latencies\n"
+             "  --wait-slack us ................. Set initial time before sending times at which -wh wakes up (defaults to 50)\n"
+             "  --batch-window us ............... Send requests due within us along with those due now (may be fractional)\n"
+             "  -ea|--exp-arrivals .............. Set exponentially distributed inter-send times for each connection\n"
+             "  --emp-arrivals file ............. Draw inter-send times from the empirical distribution in file, scaled to the rate (see README)\n"
+             "  --replay trace.bin .............. Replay the requests and send times of a trace written by dw_txt2replay over each connection\n"
+             "  -cl|--closed-loop users ......... Closed-loop mode: each connection has users outstanding requests, ignoring the rate\n"
+             "  -tt|--think-time time(us) ....... Set closed-loop think time between a reply and the next request (average, if -et is specified)\n"
+             "  -et|--exp-think ................. Set exponentially distributed closed-loop think times\n"
+             "  -mif|--max-in-flight n .......... Open-loop mode with at most n outstanding requests per connection (delaying sends if needed)\n"
              "  -rss|--ramp-step-secs secs ...... Set duration of each rate-step\n"
              "  -rfn|--rate-file-name fname ..... Load rates from specified file\n"
              "  -C|--comp-time time(us) ......... Set per-request processing time (average, if -ec is specified)\n"
              "  -ec|--exp-comp .................. Set exponentially distributed per-request processing times\n"
+             "  --emp-comp file ................. Draw per-request processing times (us) from the empirical distribution in file\n"
              "  -S|--store-data bytes ........... Set per-store data size\n"
              "  -L|--load-data bytes ............ Set per-load data size\n"
              "  -Cw|--comp-weight w ............. Set weight of COMPUTE in weighted random choice of operation\n"
              "  -Sw|--store-weight w ............ Set weight of STORE in weighted random choice of operation\n"
              "  -Lw|--load-weight w ............. Set weight of LOAD in weighted random choice of operation\n"
-             "  -ps bytes ....................... Set size of sent requests (average, if -eps is specified)\n"
+             "  -ps bytes ....................... Set size of sent requests (average, if -eps is specified; at most 16 MiB through --proxy nodes)\n"
              "  -eps|--exp-req-size ............. Set exponentially distributed size of sent requests\n"
-             "  -rs bytes ....................... Set size of received responses (average, if -ers is specified)\n"
+             "  --emp-req-size file ............. Draw sizes of sent requests from the empirical distribution in file\n"
+             "  -rs bytes ....................... Set size of received responses (average, if -ers is specified; at most 16 MiB through --proxy nodes)\n"
              "  -ers|--exp-resp-size ............ Set exponentially distributed size of received responses\n"
+             "  --emp-resp-size file ............ Draw sizes of received responses from the empirical distribution in file\n"
              "  -nd|--no-delay [0|1] ............ Set value of TCP_NO_DELAY socket option\n"
-             "  -nt|--num-threads threads ....... Set number of threads\n"
-             "  -ns|--num-sessions .............. Set number of sessions each thread establishes with the server\n"
-             "  -pso|--per-session-output ....... Output response times at end of each session (implies some delay between sessions but saves memory)\n"
+             "  --tcp-fastopen .................. Send the first request of each session in the SYN, with TCP Fast Open (to dw_node --tcp-fastopen)\n"
+             "  --udp ........................... Send requests as UDP datagrams (to dw_node --udp), of up to 65507 bytes\n"
+             "  --udp-timeout us ................ Account UDP requests not replied to within us as lost (defaults to 100000)\n"
+             "  --unix path ..................... Connect to a co-located node over its Unix domain socket (dw_node --unix)\n"
+             "  --shm path ...................... Exchange messages with a co-located node through shared-memory rings, set up over its socket (dw_node --shm)\n"
+             "  --shm-size bytes ................ Set size of each shared-memory ring, a power of 2 (defaults to 1048576)\n"
+             "  -nt|--num-threads threads ....... Set number of connections and of worker threads\n"
+             "  -nc|--connections conns ......... Set number of concurrent connections to the server\n"
+             "  -nw|--workers workers ........... Set number of worker threads driving the connections (defaults to min(conns, CPUs))\n"
+             "  -ns|--num-sessions .............. Set number of sessions each connection establishes with the server\n"
+             "  -pso|--per-session-output ....... Output response times at end of each session (implies some delay between sessions)\n"
+             "  -nso|--no-samples-output ........ Do not output per-request response times, only their summary\n"
+             "  -ri|--report-interval secs ...... Output send/reply rates, in-flight requests and response time percentiles every secs\n"
+             "  --slo pP:us ..................... Search the max rate (starting from -r) with the P-th percentile below us (e.g., p99:5000)\n"
+             "  --search-warmup secs ............ Set duration of the warm-up of each search step, excluded from its stats (default 1)\n"
+             "  --search-secs secs .............. Set duration of the measurement of each search step (default 5)\n"
+             "  --search-precision rate ......... Stop bisecting when the rate is known within rate (default 1%% of -r)\n"
+             "  --search-max-rate rate .......... Do not search beyond rate\n"
+             "  --warmup-secs secs .............. Exclude from the summary requests sent in the first secs\n"
+             "  --warmup-pkts n ................. Exclude from the summary the first n requests of each session\n"
+             "  --cooldown-secs secs ............ Exclude from the summary requests sent in the last secs\n"
+             "  --cooldown-pkts n ............... Exclude from the summary the last n requests of each session\n"
+             "  --steady-state .................. Exclude from the summary requests sent before the detected steady state\n"
+             "  --steady-window secs ............ Set window over which mean response times are compared to detect the steady state (default 1)\n"
+             "  --steady-tol frac ............... Set max relative deviation of window means from their mean in the steady state (default 0.1)\n"
+             "  -sts|--server-timestamps ........ Output per-request network-out, queueing, service and network-back times from node timestamps\n"
+             "  --node-stats .................... Query and print node-side latency stats at the end\n"
+             "  --node-stats-reset .............. Reset node-side latency stats before starting\n"
+             "  --samples prefix ................ Keep per-request samples in binary files prefix-<worker>.bin (see samples.h)\n"
+             "  --trace trace.bin ............... Trace send/receive events in memory, dumping them at exit or on SIGINT/SIGUSR1\n"
+             "  --trace-size events ............. Size of the in-memory trace ring of each worker thread\n"
              "\n"
              "  Notes:\n"
              "    Packet sizes are in bytes and do not consider headers added on lower network levels (TCP+IP+Ethernet = 66 bytes)\n"
@@ -427,6 +2062,27 @@ int main(int argc, char *argv[]) {
       assert(argc >= 2);
       server_port = atoi(argv[1]);
       argc--;  argv++;
+    } else if (strcmp(argv[0], "--servers") == 0) {
+      assert(argc >= 2);
+      servers = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-lb") == 0 || strcmp(argv[0], "--lb-policy") == 0) {
+      assert(argc >= 2);
+      int p;
+      for (p = 0; p < sizeof(lb_policy_names) / sizeof(lb_policy_names[0]); p++)
+        if (strcmp(argv[1], lb_policy_names[p]) == 0)
+          break;
+      if (p == sizeof(lb_policy_names) / sizeof(lb_policy_names[0])) {
+        printf("Unknown load-balancing policy: %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+      }
+      lb_policy = p;
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--hash-keys") == 0) {
+      assert(argc >= 2);
+      hash_keys = strtoul(argv[1], NULL, 10);
+      check(hash_keys > 0);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-b") == 0) {
       assert(argc >= 2);
       bindname = argv[1];
@@ -438,6 +2094,7 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[0], "-n") == 0) {
       assert(argc >= 2);
       num_pkts = atoi(argv[1]);
+      num_pkts_set = 1;
       argc--;  argv++;
     } else if (strcmp(argv[0], "-c") == 0) {
       assert(argc >= 2);
@@ -461,6 +2118,31 @@ int main(int argc, char *argv[]) {
       argc--;  argv++;
     } else if (strcmp(argv[0], "-ea") == 0 || strcmp(argv[0], "--exp-arrivals") == 0) {
       exp_arrivals = 1;
+    } else if (strcmp(argv[0], "--emp-arrivals") == 0) {
+      assert(argc >= 2);
+      check(emp_load(&emp_arrivals, argv[1]) == 0);
+      check(emp_arrivals.mean > 0);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--replay") == 0) {
+      assert(argc >= 2);
+      replay_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-cl") == 0 || strcmp(argv[0], "--closed-loop") == 0) {
+      assert(argc >= 2);
+      closed_loop = atoi(argv[1]);
+      check(closed_loop >= 1);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-tt") == 0 || strcmp(argv[0], "--think-time") == 0) {
+      assert(argc >= 2);
+      think_time_us = atol(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-et") == 0 || strcmp(argv[0], "--exp-think") == 0) {
+      exp_think = 1;
+    } else if (strcmp(argv[0], "-mif") == 0 || strcmp(argv[0], "--max-in-flight") == 0) {
+      assert(argc >= 2);
+      max_in_flight = atoi(argv[1]);
+      check(max_in_flight >= 1);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-rdr") == 0 || strcmp(argv[0], "--ramp-delta-rate") == 0) {
       assert(argc >= 2);
       ramp_delta_rate = atoi(argv[1]);
@@ -503,35 +2185,163 @@ int main(int argc, char *argv[]) {
       argc--;  argv++;
     } else if (strcmp(argv[0], "-ec") == 0 || strcmp(argv[0], "--exp-comp") == 0) {
       exp_comptimes = 1;
+    } else if (strcmp(argv[0], "--emp-comp") == 0) {
+      assert(argc >= 2);
+      check(emp_load(&emp_comptimes, argv[1]) == 0);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-ws") == 0 || strcmp(argv[0], "--waitspin") == 0) {
       wait_spinning = 1;
+    } else if (strcmp(argv[0], "-wh") == 0 || strcmp(argv[0], "--wait-hybrid") == 0) {
+      wait_hybrid = 1;
+    } else if (strcmp(argv[0], "--wait-slack") == 0) {
+      assert(argc >= 2);
+      wait_slack_ns = atol(argv[1]) * 1000;
+      check(wait_slack_ns >= WAIT_SLACK_MIN_NS && wait_slack_ns <= WAIT_SLACK_MAX_NS);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--batch-window") == 0) {
+      assert(argc >= 2);
+      batch_window_ns = lround(atof(argv[1]) * 1000);
+      check(batch_window_ns >= 0);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-pso") == 0 || strcmp(argv[0], "--per-session-output") == 0) {
       per_session_output = 1;
+    } else if (strcmp(argv[0], "-nso") == 0 || strcmp(argv[0], "--no-samples-output") == 0) {
+      samples_output = 0;
+    } else if (strcmp(argv[0], "--slo") == 0) {
+      assert(argc >= 2);
+      int fields = sscanf(argv[1], "p%lf:%lu", &slo_perc, &slo_us);
+      check(fields == 2 && slo_perc > 0 && slo_perc <= 100);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--search-warmup") == 0) {
+      assert(argc >= 2);
+      search_warmup_secs = atof(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--search-secs") == 0) {
+      assert(argc >= 2);
+      search_secs = atof(argv[1]);
+      check(search_secs > 0);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--search-precision") == 0) {
+      assert(argc >= 2);
+      search_precision = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--search-max-rate") == 0) {
+      assert(argc >= 2);
+      search_max_rate = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--warmup-secs") == 0) {
+      assert(argc >= 2);
+      warmup_secs = atof(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--warmup-pkts") == 0) {
+      assert(argc >= 2);
+      warmup_pkts = atol(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--cooldown-secs") == 0) {
+      assert(argc >= 2);
+      cooldown_secs = atof(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--cooldown-pkts") == 0) {
+      assert(argc >= 2);
+      cooldown_pkts = atol(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--steady-state") == 0) {
+      steady_state = 1;
+    } else if (strcmp(argv[0], "--steady-tol") == 0) {
+      assert(argc >= 2);
+      steady_tol = atof(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--steady-window") == 0) {
+      assert(argc >= 2);
+      steady_window_secs = atof(argv[1]);
+      check(steady_window_secs > 0);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-ri") == 0 || strcmp(argv[0], "--report-interval") == 0) {
+      assert(argc >= 2);
+      report_interval = atof(argv[1]);
+      check(report_interval >= 0);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-ps") == 0 || strcmp(argv[0], "--pkt-size") == 0) {
       assert(argc >= 2);
       pkt_size = atol(argv[1]);
       argc--;  argv++;
     } else if (strcmp(argv[0], "-eps") == 0 || strcmp(argv[0], "--exp-pkt-size") == 0) {
       exp_pkt_size = 1;
+    } else if (strcmp(argv[0], "--emp-req-size") == 0) {
+      assert(argc >= 2);
+      check(emp_load(&emp_pkt_size, argv[1]) == 0);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-rs") == 0 || strcmp(argv[0], "--resp-size") == 0) {
       assert(argc >= 2);
       resp_size = atol(argv[1]);
       argc--;  argv++;
     } else if (strcmp(argv[0], "-ers") == 0 || strcmp(argv[0], "--exp-resp-size") == 0) {
       exp_resp_size = 1;
+    } else if (strcmp(argv[0], "--emp-resp-size") == 0) {
+      assert(argc >= 2);
+      check(emp_load(&emp_resp_size, argv[1]) == 0);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--tcp-fastopen") == 0) {
+      tcp_fastopen = 1;
+    } else if (strcmp(argv[0], "--udp") == 0) {
+      udp = 1;
+      max_msg_size = UDP_MAX_SIZE;
+    } else if (strcmp(argv[0], "--udp-timeout") == 0) {
+      assert(argc >= 2);
+      udp_timeout_us = strtoul(argv[1], NULL, 10);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--unix") == 0) {
+      assert(argc >= 2);
+      unix_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--shm") == 0) {
+      assert(argc >= 2);
+      shm_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--shm-size") == 0) {
+      assert(argc >= 2);
+      shm_size = strtoul(argv[1], NULL, 10);
+      check(shm_size >= MIN_SEND_SIZE && (shm_size & (shm_size - 1)) == 0);
+      argc--;  argv++;
     } else if (strcmp(argv[0], "-nd") == 0 || strcmp(argv[0], "--no-delay") == 0) {
       assert(argc >= 2);
       no_delay = atoi(argv[1]);
       argc--;  argv++;
     } else if (strcmp(argv[0], "-nt") == 0 || strcmp(argv[0], "--num-threads") == 0) {
       assert(argc >= 2);
-      num_threads = atoi(argv[1]);
+      num_conns = num_workers = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-nc") == 0 || strcmp(argv[0], "--connections") == 0) {
+      assert(argc >= 2);
+      num_conns = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-nw") == 0 || strcmp(argv[0], "--workers") == 0) {
+      assert(argc >= 2);
+      num_workers = atoi(argv[1]);
       argc--;  argv++;
     } else if (strcmp(argv[0], "-ns") == 0 || strcmp(argv[0], "--num-sessions") == 0) {
       assert(argc >= 2);
       num_sessions = atoi(argv[1]);
       check(num_sessions >= 1);
       argc--;  argv++;
+    } else if (strcmp(argv[0], "-sts") == 0 || strcmp(argv[0], "--server-timestamps") == 0) {
+      server_timestamps = 1;
+    } else if (strcmp(argv[0], "--samples") == 0) {
+      assert(argc >= 2);
+      samples_prefix = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--trace") == 0) {
+      assert(argc >= 2);
+      trace_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--trace-size") == 0) {
+      assert(argc >= 2);
+      trace_size = atol(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--node-stats") == 0) {
+      node_stats = 1;
+    } else if (strcmp(argv[0], "--node-stats-reset") == 0) {
+      node_stats_reset = 1;
     } else {
       printf("Unrecognized option: %s\n", argv[0]);
       exit(EXIT_FAILURE);
@@ -583,53 +2393,132 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // streamed messages carry no timestamps (see STREAM_MAX_SIZE)
+  if (server_timestamps && max_msg_size > BUF_SIZE)
+    max_msg_size = BUF_SIZE;
+  if (replay_path != NULL) {
+    // the trace sets the pace
+    check(ramp_step_secs == 0 && slo_perc == 0);
+    replay_load(replay_path);
+    if (!num_pkts_set)
+      num_pkts = replay_num;
+  }
+
+  if (slo_perc > 0) {
+    // run until the search is over
+    check(ramp_step_secs == 0 && closed_loop == 0 && num_sessions == 1);
+    num_pkts = 1ul << 62;
+    samples_output = 0;
+  }
+
   num_pkts = (num_pkts + num_sessions - 1) / num_sessions * num_sessions;
   pkts_per_session = num_pkts / num_sessions;
 
-  assert(num_pkts <= MAX_PKTS || (per_session_output && pkts_per_session <= MAX_PKTS));
+  check(num_conns >= 1);
+  check(!(exp_arrivals && emp_arrivals.n > 0) && !(exp_comptimes && emp_comptimes.n > 0));
+  check(!(exp_pkt_size && emp_pkt_size.n > 0) && !(exp_resp_size && emp_resp_size.n > 0));
+  check(closed_loop == 0 || max_in_flight == 0);
+  if (num_workers == 0) {
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1)
+      num_workers = 1;
+  }
+  if (num_workers > num_conns)
+    num_workers = num_conns;
+  rate_start = rate;
 
   printf("Configuration:\n");
   printf("  bind=%s:%d\n", bindname, bind_port);
-  printf("  hostname=%s:%d\n", hostname, server_port);
-  printf("  num_threads: %d\n", num_threads);
+  if (servers == NULL)
+    printf("  hostname=%s:%d\n", hostname, server_port);
+  else
+    printf("  servers=%s, lb_policy=%s, hash_keys=%lu\n", servers, lb_policy_names[lb_policy], hash_keys);
+  printf("  num_conns: %d, num_workers: %d\n", num_conns, num_workers);
   printf("  num_pkts=%lu (COMPUTE:%d, STORE:%d, LOAD:%d)\n", num_pkts, n_compute, n_store, n_load);
-  printf("  rate=%d, exp_arrivals=%d\n",
-	 rate, exp_arrivals);
-  printf("  waitspin=%d\n", wait_spinning);
+  printf("  rate=%d, exp_arrivals=%d, emp_arrivals=%d\n",
+	 rate, exp_arrivals, emp_arrivals.n);
+  printf("  replay: %s (%lu requests)\n", replay_path ? replay_path : "-", replay_num);
+  printf("  waitspin=%d, wait_hybrid=%d, wait_slack_us=%ld, batch_window_ns=%ld\n", wait_spinning, wait_hybrid, wait_slack_ns / 1000, batch_window_ns);
+  printf("  closed_loop=%d, think_time_us=%lu, exp_think=%d, max_in_flight=%d\n",
+	 closed_loop, think_time_us, exp_think, max_in_flight);
   printf("  ramp_num_steps=%d, ramp_delta_rate=%d, ramp_step_secs=%d\n",
 	 ramp_num_steps, ramp_delta_rate, ramp_step_secs);
-  printf("  comptime_us=%lu, exp_comptimes=%d\n",
-	 comptimes_us, exp_comptimes);
-  printf("  pkt_size=%lu (%lu with headers), exp_pkt_size=%d\n",
-	 pkt_size, pkt_size+TCPIP_HEADERS_SIZE, exp_pkt_size);
-  printf("  resp_size=%lu (%lu with headers), exp_resp_size=%d\n",
-	 resp_size, resp_size+TCPIP_HEADERS_SIZE, exp_resp_size);
+  printf("  comptime_us=%lu, exp_comptimes=%d, emp_comptimes=%d\n",
+	 comptimes_us, exp_comptimes, emp_comptimes.n);
+  printf("  pkt_size=%lu (%lu with headers), exp_pkt_size=%d, emp_pkt_size=%d\n",
+	 pkt_size, pkt_size+TCPIP_HEADERS_SIZE, exp_pkt_size, emp_pkt_size.n);
+  printf("  resp_size=%lu (%lu with headers), exp_resp_size=%d, emp_resp_size=%d\n",
+	 resp_size, resp_size+TCPIP_HEADERS_SIZE, exp_resp_size, emp_resp_size.n);
   printf("  min packet size due to header: send=%lu, reply=%lu\n", MIN_SEND_SIZE, MIN_REPLY_SIZE);
-  printf("  max packet size: %d\n", BUF_SIZE);
-  printf("  no_delay: %d\n", no_delay);
+  printf("  max packet size: %lu (streamed beyond %d)\n", max_msg_size, BUF_SIZE);
+  printf("  no_delay: %d, tcp_fastopen: %d\n", no_delay, tcp_fastopen);
+  printf("  udp: %d, udp_timeout_us: %lu\n", udp, udp_timeout_us);
+  if (unix_path || shm_path)
+    printf("  unix: %s, shm: %s, shm_size: %u\n", unix_path ? unix_path : "-", shm_path ? shm_path : "-", shm_size);
   printf("  num_sessions: %d\n", num_sessions);
-  printf("  per_session_output: %d\n", per_session_output);
+  printf("  per_session_output: %d, samples_output: %d\n", per_session_output, samples_output);
+  printf("  report_interval: %g\n", report_interval);
+  printf("  warmup_secs: %g, warmup_pkts: %lu, cooldown_secs: %g, cooldown_pkts: %lu, steady_state: %d\n",
+         warmup_secs, warmup_pkts, cooldown_secs, cooldown_pkts, steady_state);
+  if (slo_perc > 0)
+    printf("  slo: p%g < %lu us, search_warmup: %g s, search_secs: %g s, search_max_rate: %u\n",
+           slo_perc, slo_us, search_warmup_secs, search_secs, search_max_rate);
+  printf("  server_timestamps: %d\n", server_timestamps);
+  printf("  node_stats: %d, node_stats_reset: %d\n", node_stats, node_stats_reset);
 
   assert(pkt_size >= MIN_SEND_SIZE);
-  assert(pkt_size <= BUF_SIZE);
+  assert(pkt_size <= max_msg_size);
   assert(resp_size >= MIN_REPLY_SIZE);
-  assert(resp_size <= BUF_SIZE);
+  assert(resp_size <= max_msg_size);
+  // STORE payloads and LOAD data travel within the messages
+  check(pkt_size + store_nbytes <= max_msg_size);
+  check(resp_size + load_nbytes <= max_msg_size);
   assert(no_delay == 0 || no_delay == 1);
+  // local transports reach the single node at -sn:-sp, still queried over TCP with --node-stats
+  check(!(unix_path || shm_path) || (servers == NULL && !udp));
+  check(!(unix_path && shm_path));
+
+  // a single backend unless --servers is given
+  if (servers == NULL) {
+    num_backends = 1;
+    backends = calloc(1, sizeof(backends[0]));
+    check(backends != NULL);
+    backends[0].host = hostname;
+    backends[0].port = server_port;
+  } else {
+    char *list = strdup(servers), *save, *tok;
+    for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+      char *colon = strrchr(tok, ':');
+      backends = realloc(backends, (num_backends + 1) * sizeof(backends[0]));
+      check(backends != NULL);
+      backend_t *be = &backends[num_backends++];
+      memset(be, 0, sizeof(*be));
+      be->host = tok;
+      be->port = server_port;
+      if (colon != NULL) {
+        *colon = '\0';
+        be->port = atoi(colon + 1);
+      }
+    }
+    check(num_backends > 0);
+  }
 
-  //Init random number generator
-  srand(time(NULL));
-
-  cw_log("Resolving %s...\n", hostname);
-  struct hostent *e = gethostbyname(hostname);
-  check(e != NULL);
-  cw_log("Host %s resolved to %d bytes: %s\n", hostname, e->h_length, inet_ntoa(*(struct in_addr *)e->h_addr));
-
-  /* build the server's Internet address */
-  bzero((char *) &serveraddr, sizeof(serveraddr));
-  serveraddr.sin_family = AF_INET;
-  bcopy((char *)e->h_addr, 
-	(char *)&serveraddr.sin_addr.s_addr, e->h_length);
-  serveraddr.sin_port = htons(server_port);
+  for (int b = 0; b < num_backends; b++) {
+    backend_t *be = &backends[b];
+    cw_log("Resolving %s...\n", be->host);
+    struct hostent *e = gethostbyname(be->host);
+    check(e != NULL);
+    cw_log("Host %s resolved to %d bytes: %s\n", be->host, e->h_length, inet_ntoa(*(struct in_addr *)e->h_addr));
+
+    /* build the server's Internet address */
+    bzero((char *) &be->addr, sizeof(be->addr));
+    be->addr.sin_family = AF_INET;
+    bcopy((char *)e->h_addr,
+          (char *)&be->addr.sin_addr.s_addr, e->h_length);
+    be->addr.sin_port = htons(be->port);
+  }
+  if (lb_policy == LB_HASH)
+    ring_build();
 
   cw_log("Resolving %s...\n", bindname);
   struct hostent *e2 = gethostbyname(bindname);
@@ -645,19 +2534,85 @@ int main(int argc, char *argv[]) {
   /* Set all bits of the padding field to 0 */
   memset(myaddr.sin_zero, '\0', sizeof(myaddr.sin_zero));
 
-  for (int i = 0; i < MAX_THREADS; i++)
-    clientSocket[i] = -1;
+  conns = calloc(num_conns, sizeof(conns[0]));
+  workers = calloc(num_workers, sizeof(workers[0]));
+  check(conns != NULL && workers != NULL);
+  for (int i = 0; i < num_conns; i++) {
+    conns[i].conn_id = i;
+    conns[i].heap_idx = -1;
+  }
+  // worker w drives a contiguous block of conns
+  for (int w = 0; w < num_workers; w++) {
+    int first = w * num_conns / num_workers;
+    workers[w].worker_id = w;
+    workers[w].conns = &conns[first];
+    workers[w].num_conns = (w + 1) * num_conns / num_workers - first;
+    workers[w].backend_hist = calloc(num_backends, sizeof(hist_t));
+    check(workers[w].backend_hist != NULL);
+  }
+
+  if (node_stats_reset)
+    for (int b = 0; b < num_backends; b++)
+      node_stats_query(b, STATS_RESET, 0);
+
+  // Trace events in memory, with one ring per worker thread
+  if (trace_path) {
+    trace_init(trace_path, trace_size, num_workers);
+    signal(SIGUSR1, sigusr1_trace_dump);
+    signal(SIGINT, sigint_trace_dump);
+  }
 
   // Remember in ts_start the abs start time of the experiment
   clock_gettime(clk_id, &ts_start);
 
-  for (int i = 0; i < num_threads; i++)
-    assert(pthread_create(&receiver[i], NULL, thread_receiver, (void *)(unsigned long)i) == 0);
+  for (int w = 0; w < num_workers; w++) {
+    char path[256];
+    if (samples_prefix)
+      snprintf(path, sizeof(path), "%s-%d.bin", samples_prefix, w);
+    samples_open(&workers[w].samples, samples_prefix ? path : NULL, w, ts_to_ns(ts_start));
+  }
+
+  for (int w = 0; w < num_workers; w++)
+    assert(pthread_create(&workers[w].thread, NULL, thread_worker, (void *)&workers[w]) == 0);
+
+  if (report_interval > 0)
+    assert(pthread_create(&reporter, NULL, thread_reporter, NULL) == 0);
+
+  if (slo_perc > 0)
+    search_rate();
+
+  for (int w = 0; w < num_workers; w++)
+    pthread_join(workers[w].thread, NULL);
+
+  if (report_interval > 0) {
+    pthread_mutex_lock(&reporter_mtx);
+    workers_done = 1;
+    pthread_cond_signal(&reporter_cond);
+    pthread_mutex_unlock(&reporter_mtx);
+    pthread_join(reporter, NULL);
+  }
+
+  cw_log("Joined worker threads, exiting\n");
+
+  for (int w = 0; w < num_workers; w++) {
+    samples_t *smp = &workers[w].samples;
+    if (!per_session_output && samples_output)
+      for (uint64_t i = 0; i < samples_num(smp); i++)
+        print_sample(samples_get(smp, i));
+  }
+
+  if (!measure_all())
+    set_measured_window();
+  print_summary();
+
+  for (int w = 0; w < num_workers; w++)
+    samples_close(&workers[w].samples);
 
-  for (int i = 0; i < num_threads; i++)
-    pthread_join(receiver[i], NULL);
+  if (node_stats)
+    for (int b = 0; b < num_backends; b++)
+      node_stats_query(b, 0, 1);
 
-  cw_log("Joined sender and receiver threads, exiting\n");
+  trace_dump();
 
   return 0;
 }
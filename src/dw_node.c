@@ -2,13 +2,21 @@
 #include "message.h"
 #include "timespec.h"
 #include "cw_debug.h"
+#include "histogram.h"
+#include "counters.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "shm_ring.h"
 
 #include <sys/types.h>          /* See NOTES */
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/un.h>
 
 #include <stdio.h>
 #include <signal.h>
@@ -23,7 +31,10 @@
 #include <errno.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/filter.h>
 
 #define MAX_EVENTS 10
 
@@ -43,6 +54,23 @@ typedef struct {
   int sock;
   req_status status;
   int orig_sock_id;             // ID in socks[]
+  uint64_t conn_id;		// unique across accepted connections
+
+  // with --shm, rings replacing recv() and send() on sock, which is
+  // only watched for the client closing it
+  shm_ring_t *shm_rx;		// NULL for socket conns
+  shm_ring_t *shm_tx;
+  void *shm_map;
+  unsigned long shm_map_size;
+  int shm_efd_in;		// signaled by the client on new requests
+  int shm_efd_out;		// signaled to the client on new replies
+
+  // a message larger than buf_size is streamed: its header and cmds[]
+  // stay at the start of buf, the rest of it being received over the
+  // rest of buf, and written to storage as it arrives for a STORE
+  unsigned long stream_left;	// bytes yet to be received, 0 if not streaming
+  unsigned long stream_store;	// bytes yet to be stored
+  int stream_stored;		// the first STORE of the message was streamed
   pthread_mutex_t mtx;
 } buf_info;
 
@@ -57,7 +85,9 @@ static volatile int node_running = 1; //epoll_main_loop flag
 
 #define MAX_BUFFERS 16
 
-buf_info bufs[MAX_BUFFERS];
+// bufs[UDP_BUF_ID] is used for messages received over UDP
+#define UDP_BUF_ID MAX_BUFFERS
+buf_info bufs[MAX_BUFFERS + 1];
 pthread_t workers[MAX_BUFFERS];
 thread_info thread_infos[MAX_BUFFERS];
 
@@ -81,6 +111,103 @@ int per_client_thread = 0;
 
 int epollfd;
 
+clockid_t clk_id = CLOCK_REALTIME;
+
+// UDP mode (--udp): messages are also accepted as datagrams on the same
+// port, and handled by the main thread in batches of up to UDP_BATCH,
+// received with a single recvmmsg() and replied to with a single
+// sendmmsg()
+#define UDP_BATCH 32
+
+int udp = 0;
+int udp_sock = -1;
+
+// Local transports: Unix domain stream sockets (--unix), and shared
+// memory rings set up over a Unix domain socket (--shm), whose epoll
+// data.u32 is SHM_SOCK_TAG | buf_id, the data.u32 of its eventfd being
+// buf_id
+#define SHM_SOCK_TAG 0x20000
+char *unix_path = NULL;
+char *shm_path = NULL;
+int unix_sock = -1;
+int shm_sock = -1;
+
+// Accepting conns: the TCP listening sockets, one per acceptor
+#define MAX_ACCEPTORS 8
+int acceptors = 1;
+int listen_socks[MAX_ACCEPTORS];
+pthread_t acceptor_threads[MAX_ACCEPTORS];
+thread_info acceptor_infos[MAX_ACCEPTORS];	// [0] unused (main thread)
+int listen_backlog = SOMAXCONN;
+int reuseport_cbpf = 0;
+int tcp_fastopen = 0;		// TFO queue length, 0 to disable
+uint64_t next_conn_id = 0;
+unsigned long shm_spin_us = 0;	// poll rings before sleeping on their eventfd
+struct mmsghdr udp_in[UDP_BATCH], udp_out[UDP_BATCH];
+struct iovec udp_in_iov[UDP_BATCH], udp_out_iov[UDP_BATCH];
+struct sockaddr_in udp_addr[UDP_BATCH];
+unsigned char *udp_out_buf;	// UDP_BATCH replies of up to UDP_MAX_SIZE
+int udp_num_out;		// replies queued in udp_out[]
+int udp_curr;			// index in udp_in[] of the message being executed
+
+// Proxy mode (--proxy): requests are not executed, but relayed as they
+// are to one of the backend nodes, whose replies are relayed back
+#define MAX_BACKENDS 16
+
+typedef struct {
+  char *host;
+  int port;
+  struct sockaddr_in addr;
+  uint64_t outstanding;		// relayed requests awaiting a reply, across threads
+  uint64_t ewma_ns;		// moving average of the reply latency
+  uint64_t down_until_ns;	// not picked until then, after a failed connect()
+} backend_info;
+
+#define PROXY_RETRY_NS 1000000000ul	// time before retrying a backend found down
+
+backend_info backends[MAX_BACKENDS];
+int num_backends = 0;
+
+typedef enum { PROXY_LO, PROXY_EWMA, PROXY_P2C } proxy_policy_t;
+const char *proxy_policy_names[] = { "lo", "ewma", "p2c" };
+proxy_policy_t proxy_policy = PROXY_LO;
+int proxy_conns = 1;		// pooled connections to each backend, per thread
+
+// relayed request awaiting a reply, to be relayed back to conn_id
+typedef struct {
+  int buf_id;
+  uint64_t conn_id;
+  uint64_t send_ns;
+} pending_req;
+
+// Persistent connection of a thread to a backend. Backends reply to
+// requests in the order they were sent, so pending[] is a FIFO of the
+// relayed requests that expect a reply
+typedef struct {
+  int sock;			// -1 until first used
+  int backend;
+  unsigned char *buf;		// replies being received
+  unsigned long len;
+  pending_req *pending;		// circular, power-of-2 capacity
+  unsigned long pending_head;
+  unsigned long pending_len;
+  unsigned long pending_cap;
+} pconn_info;
+
+// epoll data.u32 of pooled connections, PCONN_TAG | index in thr_pconns[]
+#define PCONN_TAG 0x10000
+
+static __thread pconn_info *thr_pconns;	// [num_backends * proxy_conns]
+static __thread int thr_epollfd;
+static __thread unsigned int thr_seed;
+static __thread unsigned long thr_rr;
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(clk_id, &ts);
+  return ts_to_ns(ts);
+}
+
 // return sock associated to inaddr:port
 int sock_find_addr(in_addr_t inaddr, int port) {
   eventually_ignore_sys(pthread_mutex_lock(&socks_mtx), (per_client_thread == 1));
@@ -116,6 +243,250 @@ int sock_find_sock(int sock) {
 char* storage_path = NULL;
 int storage_fd = -1;
 
+// Per-thread latency histograms (in ns), written lock-free by their
+// own thread and merged on demand by STATS: slot 0 is used by the
+// main thread, slot i+1 by worker i (--per-client-thread), and slot
+// MAX_BUFFERS+i by acceptor i > 0 (--acceptors)
+#define MAX_STATS_SLOTS (MAX_BUFFERS + MAX_ACCEPTORS)
+hist_t node_hist[MAX_STATS_SLOTS][STAT_NUM];
+static __thread hist_t *thr_hist;
+
+// merged histograms at the time of the last STATS_RESET, subtracted
+// from node_hist[] when reporting
+hist_t node_hist_base[STAT_NUM];
+uint64_t node_stats_start_ns;
+pthread_mutex_t node_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Live counters, in shared memory with --shm-counters, using the same
+// per-thread slots as node_hist[]
+int shm_counters = 0;
+char shm_name[64];
+node_counters_t node_counters_local;
+node_counters_t *node_counters = &node_counters_local;
+static __thread thread_counters_t *thr_ctr;
+
+char *trace_path = NULL;
+unsigned long trace_size = 65536;	// events per thread
+
+// Per-thread perf event counters (--perf-events), aggregated like
+// node_hist[] and reported by STATS
+int perf_events = 0;
+perf_stats_t node_perf[MAX_STATS_SLOTS];
+perf_stats_t node_perf_base;
+static __thread perf_stats_t *thr_perf;
+static __thread perf_group_t thr_perf_group;
+
+// Busy polling (--busy-poll us): reactor threads spin on non-blocking
+// epoll_wait() for up to busy_poll_us before blocking in it, and ask the
+// kernel to busy poll sockets and epoll instances for as long, where
+// supported; spin and sleep times are aggregated like node_hist[]
+unsigned long busy_poll_us = 0;
+poll_stats_t node_poll[MAX_STATS_SLOTS];
+poll_stats_t node_poll_base;
+static __thread poll_stats_t *thr_poll;
+
+#ifndef EPIOCSPARAMS
+// from linux/eventpoll.h (Linux 6.9+)
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+void node_thread_init(int slot) {
+  assert(slot < MAX_STATS_SLOTS && slot < COUNTERS_MAX_THREADS);
+  thr_hist = node_hist[slot];
+  thr_ctr = &node_counters->thr[slot];
+  trace_thread_init(slot);
+  thr_perf = &node_perf[slot];
+  thr_poll = &node_poll[slot];
+  if (perf_events) {
+    if (perf_group_open(&thr_perf_group) == 0)
+      fprintf(stderr, "Warning: could not open any perf event (perf_event_paranoid?)\n");
+    __atomic_store_n(&thr_perf->avail_mask, thr_perf_group.avail_mask, __ATOMIC_RELAXED);
+    __atomic_store_n(&thr_perf->sw_mask, thr_perf_group.sw_mask, __ATOMIC_RELAXED);
+  }
+}
+
+// Per-thread clean-ups, as the thread is done
+void node_thread_exit() {
+  if (perf_events)
+    perf_group_close(&thr_perf_group);
+}
+
+// single-writer accounting of the perf counter deltas since pc_beg[]
+void perf_account(uint64_t pc_beg[PC_NUM]) {
+  uint64_t pc_end[PC_NUM];
+  perf_stats_t *p = thr_perf;
+
+  if (perf_group_read(&thr_perf_group, pc_end) < 0)
+    return;
+  for (int i = 0; i < PC_NUM; i++)
+    __atomic_store_n(&p->sum[i], p->sum[i] + pc_end[i] - pc_beg[i], __ATOMIC_RELAXED);
+  if (pc_end[PC_CTX_SWITCHES] != pc_beg[PC_CTX_SWITCHES])
+    __atomic_store_n(&p->preempted, p->preempted + 1, __ATOMIC_RELAXED);
+  if (pc_end[PC_CPU_MIGRATIONS] != pc_beg[PC_CPU_MIGRATIONS])
+    __atomic_store_n(&p->migrated, p->migrated + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->samples, p->samples + 1, __ATOMIC_RELAXED);
+}
+
+void perf_merge(perf_stats_t *dst, perf_stats_t *src) {
+  dst->avail_mask |= __atomic_load_n(&src->avail_mask, __ATOMIC_RELAXED);
+  dst->sw_mask |= __atomic_load_n(&src->sw_mask, __ATOMIC_RELAXED);
+  dst->samples += __atomic_load_n(&src->samples, __ATOMIC_RELAXED);
+  dst->preempted += __atomic_load_n(&src->preempted, __ATOMIC_RELAXED);
+  dst->migrated += __atomic_load_n(&src->migrated, __ATOMIC_RELAXED);
+  for (int i = 0; i < PC_NUM; i++)
+    dst->sum[i] += __atomic_load_n(&src->sum[i], __ATOMIC_RELAXED);
+}
+
+void poll_merge(poll_stats_t *dst, poll_stats_t *src) {
+  dst->spin_ns += __atomic_load_n(&src->spin_ns, __ATOMIC_RELAXED);
+  dst->sleep_ns += __atomic_load_n(&src->sleep_ns, __ATOMIC_RELAXED);
+  dst->sleeps += __atomic_load_n(&src->sleeps, __ATOMIC_RELAXED);
+}
+
+// SO_BUSY_POLL and SO_PREFER_BUSY_POLL on sock with --busy-poll (both
+// need CAP_NET_ADMIN, so failures are only warned about, once)
+void busy_poll_sock(int sock) {
+  static int warned = 0;
+  int usecs = busy_poll_us, one = 1;
+
+  if (busy_poll_us == 0)
+    return;
+  if ((setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0
+       || setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0)
+      && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+    perror("Warning: could not enable socket busy polling");
+}
+
+// busy poll parameters of the epoll instance epfd with --busy-poll,
+// where the kernel supports them
+void busy_poll_epoll(int epfd) {
+  static int warned = 0;
+  struct epoll_params params = { .busy_poll_usecs = busy_poll_us, .busy_poll_budget = 8, .prefer_busy_poll = 1 };
+
+  if (busy_poll_us == 0)
+    return;
+  if (ioctl(epfd, EPIOCSPARAMS, &params) < 0 && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+    perror("Warning: could not set epoll busy poll parameters");
+}
+
+// epoll_wait() with no timeout, spinning on non-blocking calls for up
+// to busy_poll_us first, accounting spin and sleep time in thr_poll;
+// without busy polling, only sleeps are counted, so that the default
+// path pays no clock reads
+int reactor_wait(int epfd, struct epoll_event *events, int maxevents) {
+  poll_stats_t *p = thr_poll;
+  uint64_t t_beg, t_end;
+  int nfds;
+
+  if (busy_poll_us == 0) {
+    nfds = epoll_wait(epfd, events, maxevents, -1);
+    __atomic_store_n(&p->sleeps, p->sleeps + 1, __ATOMIC_RELAXED);
+    return nfds;
+  }
+  t_beg = now_ns();
+  uint64_t t_stop = t_beg + busy_poll_us * 1000;
+  do {
+    nfds = epoll_wait(epfd, events, maxevents, 0);
+    t_end = now_ns();
+  } while (nfds == 0 && t_end < t_stop);
+  __atomic_store_n(&p->spin_ns, p->spin_ns + t_end - t_beg, __ATOMIC_RELAXED);
+  if (nfds != 0)
+    return nfds;
+  t_beg = t_end;
+  nfds = epoll_wait(epfd, events, maxevents, -1);
+  t_end = now_ns();
+  __atomic_store_n(&p->sleep_ns, p->sleep_ns + t_end - t_beg, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->sleeps, p->sleeps + 1, __ATOMIC_RELAXED);
+  return nfds;
+}
+
+void shm_counters_init() {
+  int fd;
+  counters_shm_name(shm_name, sizeof(shm_name), bind_port);
+  sys_check(fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  sys_check(ftruncate(fd, sizeof(node_counters_t)));
+  node_counters = mmap(NULL, sizeof(node_counters_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  check(node_counters != MAP_FAILED);
+  close(fd);
+  node_counters->num_threads = per_client_thread ? MAX_STATS_SLOTS : 1;
+  node_counters->pid = getpid();
+  __atomic_store_n(&node_counters->magic, COUNTERS_MAGIC, __ATOMIC_RELEASE);
+  cw_log("Publishing counters in shm %s\n", shm_name);
+}
+
+void shm_counters_cleanup() {
+  sys_check(munmap(node_counters, sizeof(node_counters_t)));
+  sys_check(shm_unlink(shm_name));
+}
+
+void node_stats_fill(node_stats_t *ns, uint32_t flags) {
+  static hist_t merged[STAT_NUM];	// protected by node_stats_mtx
+
+  sys_check(pthread_mutex_lock(&node_stats_mtx));
+  uint64_t t = now_ns();
+  for (int s = 0; s < STAT_NUM; s++) {
+    hist_reset(&merged[s]);
+    for (int i = 0; i < MAX_STATS_SLOTS; i++)
+      hist_merge(&merged[s], &node_hist[i][s]);
+  }
+  ns->elapsed_ns = t - node_stats_start_ns;
+  for (int s = 0; s < STAT_NUM; s++) {
+    hist_t *h = &merged[s];
+    hist_sub(h, &node_hist_base[s]);
+    ns->stats[s] = (stat_summary_t) {
+      .count = h->count,
+      .mean_ns = hist_mean(h),
+      .min_ns = hist_min(h),
+      .p50_ns = hist_percentile(h, 50.0),
+      .p90_ns = hist_percentile(h, 90.0),
+      .p99_ns = hist_percentile(h, 99.0),
+      .p999_ns = hist_percentile(h, 99.9),
+      .max_ns = hist_max(h),
+    };
+    if (flags & STATS_RESET)
+      hist_merge(&node_hist_base[s], h);
+  }
+
+  perf_stats_t *p = &ns->perf;
+  memset(p, 0, sizeof(*p));
+  for (int i = 0; i < MAX_STATS_SLOTS; i++)
+    perf_merge(p, &node_perf[i]);
+  p->samples -= node_perf_base.samples;
+  p->preempted -= node_perf_base.preempted;
+  p->migrated -= node_perf_base.migrated;
+  for (int i = 0; i < PC_NUM; i++)
+    p->sum[i] -= node_perf_base.sum[i];
+
+  poll_stats_t *ps = &ns->poll;
+  memset(ps, 0, sizeof(*ps));
+  for (int i = 0; i < MAX_STATS_SLOTS; i++)
+    poll_merge(ps, &node_poll[i]);
+  ps->spin_ns -= node_poll_base.spin_ns;
+  ps->sleep_ns -= node_poll_base.sleep_ns;
+  ps->sleeps -= node_poll_base.sleeps;
+
+  if (flags & STATS_RESET) {
+    node_stats_start_ns = t;
+    perf_merge(&node_perf_base, p);
+    poll_merge(&node_poll_base, ps);
+  }
+  sys_check(pthread_mutex_unlock(&node_stats_mtx));
+}
+
+void sigusr1_trace_dump(int _) {
+  (void)_;
+  trace_dump();
+}
+
 void sigint_cleanup(int _) {
   (void)_; //to avoid unused var warnings
   node_running = 0;
@@ -127,6 +498,8 @@ void sigint_cleanup(int _) {
       eventfd_write(thread_infos[i].terminationfd, 1);
     }
   }
+  for (int i = 1; i < acceptors; i++)
+    eventfd_write(acceptor_infos[i].terminationfd, 1);
 }
 
 // add the IP/port into the socks[] map to allow FORWARD finding an
@@ -211,6 +584,40 @@ size_t safe_recv(int sock, unsigned char *buf, size_t len) {
   return read_tot;
 }
 
+// Send len bytes of buf over the conn of bufs[buf_id], through its
+// shm ring if any, blocking (yielding the CPU) while the ring is full
+void conn_send(int sock, int buf_id, unsigned char *buf, size_t len) {
+  buf_info *b = &bufs[buf_id];
+  if (b->shm_tx == NULL || sock != b->sock) {
+    safe_send(sock, buf, len);
+    return;
+  }
+  while (len > 0) {
+    unsigned long n = shm_ring_write(b->shm_tx, buf, len);
+    if (shm_ring_cons_wakeup(b->shm_tx))
+      sys_check(eventfd_write(b->shm_efd_out, 1));
+    buf += n;
+    len -= n;
+    if (len > 0)
+      sched_yield();
+  }
+}
+
+// recv() over the conn of bufs[buf_id], through its shm ring if any
+ssize_t conn_recv(int sock, int buf_id, unsigned char *buf, size_t len) {
+  buf_info *b = &bufs[buf_id];
+  if (b->shm_rx == NULL)
+    return recv(sock, buf, len, 0);
+  unsigned long n = shm_ring_read(b->shm_rx, buf, len);
+  if (shm_ring_prod_wakeup(b->shm_rx))
+    sys_check(eventfd_write(b->shm_efd_out, 1));
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
 // Copy m header into m_dst, skipping the first cmd_id elems in m_dst->cmds[]
 void copy_tail(message_t *m, message_t *m_dst, int cmd_id) {
   // copy message header
@@ -222,10 +629,59 @@ void copy_tail(message_t *m, message_t *m_dst, int cmd_id) {
   m_dst->num = m->num - cmd_id;
 }
 
+// Copy the trailer of m into dst, appending the hop stamps in hs
+void write_stamps(message_t *m, unsigned char *dst, hop_stamps_t *hs) {
+  uint32_t n = trailer_num_hops(m);
+  memcpy(dst, (unsigned char *) m + m->req_size - TRAILER_SIZE(n), n * sizeof(*hs));
+  hs->send_ns = now_ns();
+  memcpy(dst + n * sizeof(*hs), hs, sizeof(*hs));
+  n++;
+  memcpy(dst + n * sizeof(*hs), &n, sizeof(n));
+}
+
+// With MSG_TIMESTAMPS, copy the trailer of m into m_dst appending the
+// hop stamps in hs, enlarging m_dst->req_size to keep the first
+// content_size bytes of m_dst untouched
+void append_stamps(message_t *m, message_t *m_dst, hop_stamps_t *hs, unsigned long content_size) {
+  uint32_t n = trailer_num_hops(m);
+  if (m_dst->req_size < content_size + TRAILER_SIZE(n + 1))
+    m_dst->req_size = content_size + TRAILER_SIZE(n + 1);
+  assert(m_dst->req_size <= BUF_SIZE);
+  write_stamps(m, (unsigned char *) m_dst + m_dst->req_size - TRAILER_SIZE(n + 1), hs);
+}
+
+// Send the message m_dst built in buf (of BUF_SIZE bytes) by a FORWARD
+// or REPLY of m, with its first content_size bytes set and the hop
+// stamps in hs appended with MSG_TIMESTAMPS; the content of larger
+// messages is sent in chunks of buf, as filler like for smaller ones
+void send_message(int sock, int buf_id, unsigned char *buf, message_t *m, hop_stamps_t *hs,
+                  unsigned long content_size) {
+  message_t *m_dst = (message_t *) buf;
+  if (m_dst->req_size <= BUF_SIZE) {
+    if (m->flags & MSG_TIMESTAMPS)
+      append_stamps(m, m_dst, hs, content_size);
+    conn_send(sock, buf_id, buf, m_dst->req_size);
+    return;
+  }
+  unsigned long trailer_size = (m->flags & MSG_TIMESTAMPS) ? TRAILER_SIZE(trailer_num_hops(m) + 1) : 0;
+  unsigned long left = m_dst->req_size - trailer_size;
+  cw_log("Streaming %u bytes in chunks of %d\n", m_dst->req_size, BUF_SIZE);
+  while (left > 0) {
+    unsigned long len = left < BUF_SIZE ? left : BUF_SIZE;
+    conn_send(sock, buf_id, buf, len);
+    left -= len;
+  }
+  if (trailer_size > 0) {
+    assert(trailer_size <= BUF_SIZE);
+    write_stamps(m, buf, hs);
+    conn_send(sock, buf_id, buf, trailer_size);
+  }
+}
+
 // cmd_id is the index of the FORWARD item within m->cmds[] here, we
 // remove the first (cmd_id+1) commands from cmds[], and forward the
 // rest to the next hop
-void forward(int buf_id, message_t *m, int cmd_id) {
+void forward(int buf_id, message_t *m, int cmd_id, hop_stamps_t *hs) {
   int sock = sock_find_addr(m->cmds[cmd_id].u.fwd.fwd_host, m->cmds[cmd_id].u.fwd.fwd_port);
   assert(sock != -1);
   message_t *m_dst = (message_t *) bufs[buf_id].fwd_buf;
@@ -237,19 +693,66 @@ void forward(int buf_id, message_t *m, int cmd_id) {
   cw_log("  cmds[] has %d items, pkt_size is %u\n", m_dst->num, m_dst->req_size);
   // TODO: return to epoll loop to handle sending of long packets
   // (here I'm blocking the thread)
-  safe_send(sock, bufs[buf_id].fwd_buf, m_dst->req_size);
+  trace_ev(TR_SEND_BEGIN, m->req_id, m_dst->req_size);
+  send_message(sock, buf_id, bufs[buf_id].fwd_buf, m, hs, sizeof(message_t) + m_dst->num * sizeof(command_t));
+  trace_ev(TR_SEND_END, m->req_id, 0);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_out, m_dst->req_size);
+  counters_write_end(thr_ctr);
 }
 
-void reply(int sock, int buf_id, message_t *m, int cmd_id) {
+// Queue a reply to the sender of udp_in[udp_curr], sent by udp_flush()
+void udp_queue_reply(unsigned char *buf, unsigned long len) {
+  if (len > UDP_MAX_SIZE) {
+    fprintf(stderr, "Reply of %lu bytes too large for UDP, dropping\n", len);
+    return;
+  }
+  unsigned char *dst = udp_out_buf + udp_num_out * UDP_MAX_SIZE;
+  memcpy(dst, buf, len);
+  udp_out_iov[udp_num_out] = (struct iovec) { .iov_base = dst, .iov_len = len };
+  udp_out[udp_num_out].msg_hdr = (struct msghdr) {
+    .msg_name = &udp_addr[udp_curr],
+    .msg_namelen = sizeof(udp_addr[udp_curr]),
+    .msg_iov = &udp_out_iov[udp_num_out],
+    .msg_iovlen = 1,
+  };
+  udp_num_out++;
+}
+
+// payload (if any) is placed right after the cmds[] left in the reply
+void reply(int sock, int buf_id, message_t *m, int cmd_id, hop_stamps_t *hs,
+           void *payload, unsigned long payload_size) {
   message_t *m_dst = (message_t *) bufs[buf_id].reply_buf;
 
   copy_tail(m, m_dst, cmd_id + 1);
   m_dst->req_size = m->cmds[cmd_id].u.fwd.pkt_size;
+  unsigned long off = sizeof(message_t) + m_dst->num * sizeof(command_t);
+  if (payload) {
+    if (m_dst->req_size < off + payload_size)
+      m_dst->req_size = off + payload_size;
+    memcpy(bufs[buf_id].reply_buf + off, payload, payload_size);
+  }
   cw_log("Replying to req %u\n", m->req_id);
   cw_log("  cmds[] has %d items, pkt_size is %u\n", m_dst->num, m_dst->req_size);
   // TODO: return to epoll loop to handle sending of long packets
   // (here I'm blocking the thread)
-  safe_send(sock, bufs[buf_id].reply_buf, m_dst->req_size);
+  if (sock == udp_sock) {
+    // checked before the stamps, which assume a reply fitting BUF_SIZE
+    if (m_dst->req_size > UDP_MAX_SIZE) {
+      fprintf(stderr, "Reply of %u bytes too large for UDP, dropping\n", m_dst->req_size);
+      return;
+    }
+    if (m->flags & MSG_TIMESTAMPS)
+      append_stamps(m, m_dst, hs, off + payload_size);
+    udp_queue_reply(bufs[buf_id].reply_buf, m_dst->req_size);
+    return;
+  }
+  trace_ev(TR_SEND_BEGIN, m->req_id, m_dst->req_size);
+  send_message(sock, buf_id, bufs[buf_id].reply_buf, m, hs, off + payload_size);
+  trace_ev(TR_SEND_END, m->req_id, 0);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_out, m_dst->req_size);
+  counters_write_end(thr_ctr);
 }
 
 size_t recv_message(int sock, unsigned char *buf, size_t len) {
@@ -274,27 +777,278 @@ void compute_for(unsigned long usecs) {
 
 unsigned long blk_size = 0;
 
-ssize_t store(int buf_id, size_t bytes) {
+// write bytes (at most BUF_SIZE) to storage, without syncing
+ssize_t store_write(int buf_id, size_t bytes) {
   //generate the data to be stored
   if (use_odirect)
     bytes = (bytes + blk_size - 1) / blk_size * blk_size;
   cw_log("STORE: storing %lu bytes\n", bytes);
 
   safe_write(storage_fd, bufs[buf_id].store_buf, bytes);
-  fsync(storage_fd);
 
   return bytes;
 }
 
-ssize_t load(size_t bytes) {
-  char* tmp = (char*) malloc(bytes + 1);
+// write bytes to storage, in chunks of store_buf, and sync
+ssize_t store(int buf_id, size_t bytes) {
+  size_t tot = 0;
+  while (tot < bytes) {
+    size_t len = bytes - tot < BUF_SIZE ? bytes - tot : BUF_SIZE;
+    tot += store_write(buf_id, len);
+  }
+  fsync(storage_fd);
+
+  return tot;
+}
+
+// read bytes from the start of storage, in chunks of store_buf
+ssize_t load(int buf_id, size_t bytes) {
   ssize_t read;
+  size_t tot = 0;
   cw_log("LOAD: loading %lu bytes\n", bytes);
 
-  sys_check(read = pread(storage_fd, tmp, bytes, 0));
+  while (tot < bytes) {
+    size_t len = bytes - tot < BUF_SIZE ? bytes - tot : BUF_SIZE;
+    sys_check(read = pread(storage_fd, bufs[buf_id].store_buf, len, tot));
+    if (read == 0)
+      break;
+    tot += read;
+  }
+
+  return tot;
+}
 
-  free(tmp);
-  return read;
+// Backend with the least outstanding requests, or the least expected
+// latency, i.e., EWMA latency times (outstanding + 1), or the one with
+// least outstanding requests of two random ones; ties are broken in
+// round-robin order, not to send all requests to backends[0] at low load;
+// backends found down are skipped, -1 meaning that all of them are
+int proxy_pick_backend() {
+  uint64_t now = now_ns();
+  if (proxy_policy == PROXY_P2C && num_backends > 1) {
+    int b1 = rand_r(&thr_seed) % num_backends;
+    int b2 = (b1 + 1 + rand_r(&thr_seed) % (num_backends - 1)) % num_backends;
+    int up1 = __atomic_load_n(&backends[b1].down_until_ns, __ATOMIC_RELAXED) <= now;
+    int up2 = __atomic_load_n(&backends[b2].down_until_ns, __ATOMIC_RELAXED) <= now;
+    if (up1 && up2)
+      return __atomic_load_n(&backends[b2].outstanding, __ATOMIC_RELAXED)
+        < __atomic_load_n(&backends[b1].outstanding, __ATOMIC_RELAXED) ? b2 : b1;
+    if (up1 || up2)
+      return up1 ? b1 : b2;
+  }
+  int best = -1;
+  uint64_t best_score = 0;
+  unsigned long first = thr_rr++;
+  for (int i = 0; i < num_backends; i++) {
+    int b = (first + i) % num_backends;
+    if (__atomic_load_n(&backends[b].down_until_ns, __ATOMIC_RELAXED) > now)
+      continue;
+    uint64_t score = __atomic_load_n(&backends[b].outstanding, __ATOMIC_RELAXED);
+    if (proxy_policy == PROXY_EWMA)
+      score = (score + 1) * __atomic_load_n(&backends[b].ewma_ns, __ATOMIC_RELAXED);
+    if (best == -1 || score < best_score) {
+      best = b;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+// Connect pc to its backend; returns 0 if it could not, marking the
+// backend down for PROXY_RETRY_NS
+int pconn_connect(pconn_info *pc) {
+  backend_info *be = &backends[pc->backend];
+  sys_check(pc->sock = socket(PF_INET, SOCK_STREAM, 0));
+  int val = 1;
+  sys_check(setsockopt(pc->sock, IPPROTO_TCP, TCP_NODELAY, (void *) &val, sizeof(val)));
+  busy_poll_sock(pc->sock);
+  cw_log("Connecting to backend %s:%d\n", be->host, be->port);
+  if (connect(pc->sock, (struct sockaddr *) &be->addr, sizeof(be->addr)) < 0) {
+    fprintf(stderr, "Could not connect to backend %s:%d: %s\n", be->host, be->port, strerror(errno));
+    close(pc->sock);
+    pc->sock = -1;
+    __atomic_store_n(&be->down_until_ns, now_ns() + PROXY_RETRY_NS, __ATOMIC_RELAXED);
+    return 0;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = PCONN_TAG | (pc - thr_pconns) };
+  sys_check(epoll_ctl(thr_epollfd, EPOLL_CTL_ADD, pc->sock, &ev));
+  return 1;
+}
+
+// Send all of buf over pc, without raising SIGPIPE if the backend is
+// gone; returns -1 if it failed
+int pconn_send(pconn_info *pc, unsigned char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(pc->sock, buf, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0)
+      return -1;
+    buf += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+// Whether the reply to m, if any, fits in BUF_SIZE, as proxy_recv()
+// relays whole replies: its REPLY size, plus the data of the LOADs
+// before it and any STATS it carries
+int proxy_reply_fits(message_t *m) {
+  unsigned long size = 0;
+  for (int i = 0; i < m->num && m->cmds[i].cmd != FORWARD; i++) {
+    if (m->cmds[i].cmd == LOAD) {
+      size += m->cmds[i].u.load_nbytes;
+    } else if (m->cmds[i].cmd == STATS) {
+      size += sizeof(node_stats_t);
+    } else if (m->cmds[i].cmd == REPLY) {
+      size += m->cmds[i].u.fwd.pkt_size;
+      break;
+    }
+  }
+  return size <= BUF_SIZE;
+}
+
+// Close pc, dropping the requests awaiting a reply over it; with
+// close_clients, also shut down the connections they came from, so that
+// their threads close them rather than leaving them waiting
+void pconn_close(pconn_info *pc, int close_clients) {
+  for (unsigned long i = 0; close_clients && i < pc->pending_len; i++) {
+    pending_req *p = &pc->pending[(pc->pending_head + i) & (pc->pending_cap - 1)];
+    buf_info *bi = &bufs[p->buf_id];
+    if (bi->buf != NULL && bi->conn_id == p->conn_id)
+      shutdown(bi->sock, SHUT_RDWR);
+  }
+  sys_check(epoll_ctl(thr_epollfd, EPOLL_CTL_DEL, pc->sock, NULL));
+  close(pc->sock);
+  pc->sock = -1;
+  __atomic_fetch_sub(&backends[pc->backend].outstanding, pc->pending_len, __ATOMIC_RELAXED);
+  pc->len = pc->pending_head = pc->pending_len = 0;
+}
+
+// Relay message m received over bufs[buf_id] to a backend, through a
+// pooled connection of the calling thread, connected on first use;
+// returns 0 if it could not, the conn of m being to close
+int proxy_relay(int buf_id, message_t *m) {
+  if (thr_pconns == NULL) {
+    thr_pconns = calloc(num_backends * proxy_conns, sizeof(pconn_info));
+    check(thr_pconns != NULL);
+    for (int i = 0; i < num_backends * proxy_conns; i++) {
+      thr_pconns[i].sock = -1;
+      thr_pconns[i].backend = i / proxy_conns;
+    }
+    thr_seed = time(NULL) + bufs[buf_id].sock;
+  }
+  // a failed connect marks the backend down, so the next pick is another one
+  int b;
+  pconn_info *pc;
+  do {
+    b = proxy_pick_backend();
+    if (b < 0) {
+      fprintf(stderr, "No backend available for req %u, closing conn\n", m->req_id);
+      return 0;
+    }
+    pc = &thr_pconns[b * proxy_conns + thr_rr % proxy_conns];
+  } while (pc->sock == -1 && !pconn_connect(pc));
+
+  // a reply comes back only if a REPLY precedes any FORWARD
+  int expects_reply = 0;
+  for (int i = 0; i < m->num && m->cmds[i].cmd != FORWARD; i++)
+    if (m->cmds[i].cmd == REPLY) {
+      expects_reply = 1;
+      break;
+    }
+  uint64_t t = now_ns();
+  if (expects_reply) {
+    if (pc->pending_len == pc->pending_cap) {
+      unsigned long cap = pc->pending_cap ? 2 * pc->pending_cap : 16;
+      pending_req *p = malloc(cap * sizeof(p[0]));
+      check(p != NULL);
+      for (unsigned long i = 0; i < pc->pending_len; i++)
+        p[i] = pc->pending[(pc->pending_head + i) & (pc->pending_cap - 1)];
+      free(pc->pending);
+      pc->pending = p;
+      pc->pending_head = 0;
+      pc->pending_cap = cap;
+    }
+    pc->pending[(pc->pending_head + pc->pending_len++) & (pc->pending_cap - 1)] =
+      (pending_req) { buf_id, bufs[buf_id].conn_id, t };
+    __atomic_fetch_add(&backends[b].outstanding, 1, __ATOMIC_RELAXED);
+  }
+  cw_log("Relaying req %u to backend %s:%d\n", m->req_id, backends[b].host, backends[b].port);
+  trace_ev(TR_SEND_BEGIN, m->req_id, m->req_size);
+  if (pconn_send(pc, (unsigned char *) m, m->req_size) < 0) {
+    fprintf(stderr, "Send to backend %s:%d failed: %s, dropping %lu requests and their conns\n",
+            backends[b].host, backends[b].port, strerror(errno), pc->pending_len);
+    pconn_close(pc, 1);
+    return 0;
+  }
+  trace_ev(TR_SEND_END, m->req_id, 0);
+  hist_add(&thr_hist[STAT_SEND], now_ns() - t);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_out, m->req_size);
+  counters_write_end(thr_ctr);
+  return 1;
+}
+
+// EPOLLIN on a pooled connection: relay complete replies back to the
+// connections the requests came from, unless closed meanwhile
+void proxy_recv(int idx) {
+  pconn_info *pc = &thr_pconns[idx];
+  backend_info *be = &backends[pc->backend];
+  if (pc->buf == NULL) {
+    pc->buf = malloc(BUF_SIZE);
+    check(pc->buf != NULL);
+  }
+  ssize_t received = recv(pc->sock, pc->buf + pc->len, BUF_SIZE - pc->len, 0);
+  if (received <= 0) {
+    fprintf(stderr, "Connection to backend %s:%d lost, dropping %lu requests\n",
+            be->host, be->port, pc->pending_len);
+    pconn_close(pc, 1);
+    return;
+  }
+  uint64_t t = now_ns();
+  pc->len += received;
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_in, received);
+  counters_write_end(thr_ctr);
+
+  unsigned char *buf = pc->buf;
+  while (pc->buf + pc->len - buf >= sizeof(message_t)) {
+    message_t *m = (message_t *) buf;
+    // replies are relayed whole: give up on a backend sending one that
+    // cannot be, and on the clients waiting over it, rather than crash
+    if (m->req_size < sizeof(message_t) || m->req_size > BUF_SIZE) {
+      fprintf(stderr, "Reply of %u bytes from backend %s:%d cannot be relayed, dropping %lu requests and their conns\n",
+              m->req_size, be->host, be->port, pc->pending_len);
+      pconn_close(pc, 1);
+      return;
+    }
+    if (pc->buf + pc->len - buf < m->req_size)
+      break;
+    check(pc->pending_len > 0);
+    pending_req *p = &pc->pending[pc->pending_head];
+    pc->pending_head = (pc->pending_head + 1) & (pc->pending_cap - 1);
+    pc->pending_len--;
+    __atomic_fetch_sub(&be->outstanding, 1, __ATOMIC_RELAXED);
+    hist_add(&thr_hist[STAT_PROXY], t - p->send_ns);
+    // alpha = 1/8
+    int64_t ewma = __atomic_load_n(&be->ewma_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&be->ewma_ns, ewma + ((int64_t) (t - p->send_ns) - ewma) / 8, __ATOMIC_RELAXED);
+
+    buf_info *bi = &bufs[p->buf_id];
+    if (bi->buf != NULL && bi->conn_id == p->conn_id) {
+      cw_log("Relaying reply to req %u\n", m->req_id);
+      trace_ev(TR_SEND_BEGIN, m->req_id, m->req_size);
+      conn_send(bi->sock, p->buf_id, buf, m->req_size);
+      trace_ev(TR_SEND_END, m->req_id, 0);
+      counters_write_begin(thr_ctr);
+      counters_add(thr_ctr, bytes_out, m->req_size);
+      counters_write_end(thr_ctr);
+    }
+    buf += m->req_size;
+  }
+  pc->len -= buf - pc->buf;
+  memmove(pc->buf, buf, pc->len);
 }
 
 int close_and_forget(int epollfd, int sock) {
@@ -308,21 +1062,259 @@ int close_and_forget(int epollfd, int sock) {
   return close(sock);
 }
 
+// number of complete messages in buf[0..size-1]
+unsigned long count_messages(unsigned char *buf, unsigned long size) {
+  unsigned long cnt = 0;
+  while (size >= sizeof(message_t)) {
+    message_t *m = (message_t *) buf;
+    if (m->req_size < sizeof(message_t) || size < m->req_size)
+      break;
+    cnt++;
+    buf += m->req_size;
+    size -= m->req_size;
+  }
+  return cnt;
+}
+
+// Execute the commands of message m, received over sock at t_recv and
+// parsed at t, up to the first FORWARD or REPLY
+void exec_message(int sock, int buf_id, message_t *m, uint64_t t_recv, uint64_t t) {
+  ssize_t data = -1;
+  hop_stamps_t hs = { .recv_ns = t_recv, .start_ns = t };
+  int stats_cmd = -1;
+  uint64_t pc_beg[PC_NUM];
+  int pc_pending = perf_events && perf_group_read(&thr_perf_group, pc_beg) == 0;
+  for (int i = 0; i < m->num; i++) {
+    stat_id_t stat_id;
+    if (m->cmds[i].cmd == COMPUTE) {
+      trace_ev(TR_COMPUTE_BEGIN, m->req_id, m->cmds[i].u.comp_time_us);
+      compute_for(m->cmds[i].u.comp_time_us);
+      trace_ev(TR_COMPUTE_END, m->req_id, 0);
+      stat_id = STAT_COMPUTE;
+    } else if (m->cmds[i].cmd == FORWARD) {
+      hs.end_ns = t;
+      if (pc_pending) {
+        perf_account(pc_beg);
+        pc_pending = 0;
+      }
+      forward(buf_id, m, i, &hs);
+      hist_add(&thr_hist[STAT_SEND], now_ns() - t);
+      // rest of cmds[] are for next hop, not me
+      break;
+    } else if (m->cmds[i].cmd == REPLY) {
+      //simulate data retrieve
+      if (data >= 0) {
+        if (m->cmds[i].u.fwd.pkt_size + (unsigned long) data > STREAM_MAX_SIZE) {
+          fprintf(stderr, "Reply to req %u of more than %lu bytes, dropping\n", m->req_id, STREAM_MAX_SIZE);
+          break;
+        }
+        m->cmds[i].u.fwd.pkt_size += data;
+        data = -1;
+      }
+      hs.end_ns = t;
+      if (pc_pending) {
+        perf_account(pc_beg);
+        pc_pending = 0;
+      }
+      if (stats_cmd >= 0) {
+        node_stats_t ns;
+        node_stats_fill(&ns, m->cmds[stats_cmd].u.stats_flags);
+        reply(sock, buf_id, m, i, &hs, &ns, sizeof(ns));
+      } else {
+        reply(sock, buf_id, m, i, &hs, NULL, 0);
+      }
+      hist_add(&thr_hist[STAT_SEND], now_ns() - t);
+      // any further cmds[] for replied-to hop, not me
+      break;
+    } else if (m->cmds[i].cmd == STORE && storage_path) {
+      trace_ev(TR_STORE_BEGIN, m->req_id, m->cmds[i].u.store_nbytes);
+      if (bufs[buf_id].stream_stored) {
+        // written as it arrived, but for what the payload was short of
+        store(buf_id, bufs[buf_id].stream_store);
+        bufs[buf_id].stream_store = 0;
+        bufs[buf_id].stream_stored = 0;
+      } else {
+        store(buf_id, m->cmds[i].u.store_nbytes);
+      }
+      trace_ev(TR_STORE_END, m->req_id, 0);
+      stat_id = STAT_STORE;
+    } else if (m->cmds[i].cmd == LOAD && storage_path) {
+      trace_ev(TR_LOAD_BEGIN, m->req_id, m->cmds[i].u.load_nbytes);
+      data = load(buf_id, m->cmds[i].u.load_nbytes);
+      trace_ev(TR_LOAD_END, m->req_id, 0);
+      stat_id = STAT_LOAD;
+    } else if (m->cmds[i].cmd == STATS) {
+      // deferred to the next REPLY
+      stats_cmd = i;
+      continue;
+    } else {
+      cw_log("Unknown cmd: %d\n", m->cmds[0].cmd);
+      exit(EXIT_FAILURE);
+    }
+    uint64_t t_end = now_ns();
+    hist_add(&thr_hist[stat_id], t_end - t);
+    t = t_end;
+  }
+  if (pc_pending)
+    perf_account(pc_beg);
+}
+
+// EPOLLIN on udp_sock: execute a batch of datagrams, one message each,
+// then send all the replies at once
+void udp_process() {
+  for (int i = 0; i < UDP_BATCH; i++) {
+    udp_in_iov[i] = (struct iovec) { .iov_base = bufs[UDP_BUF_ID].buf + i * UDP_MAX_SIZE, .iov_len = UDP_MAX_SIZE };
+    udp_in[i].msg_hdr = (struct msghdr) {
+      .msg_name = &udp_addr[i],
+      .msg_namelen = sizeof(udp_addr[i]),
+      .msg_iov = &udp_in_iov[i],
+      .msg_iovlen = 1,
+    };
+  }
+  int n = recvmmsg(udp_sock, udp_in, UDP_BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  sys_check(n);
+  uint64_t t_recv = now_ns();
+  unsigned long received = 0;
+  for (int i = 0; i < n; i++)
+    received += udp_in[i].msg_len;
+  cw_log("recvmmsg() returned %d datagrams, %lu bytes\n", n, received);
+  trace_ev(TR_RECV, 0, received);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_in, received);
+  counters_write_end(thr_ctr);
+
+  udp_num_out = 0;
+  for (udp_curr = 0; udp_curr < n; udp_curr++) {
+    message_t *m = (message_t *) udp_in_iov[udp_curr].iov_base;
+    if (udp_in[udp_curr].msg_len < sizeof(message_t) || m->req_size != udp_in[udp_curr].msg_len) {
+      fprintf(stderr, "Malformed datagram of %u bytes, dropping\n", udp_in[udp_curr].msg_len);
+      continue;
+    }
+    trace_ev(TR_PARSE, m->req_id, m->req_size);
+    uint64_t t = now_ns();
+    hist_add(&thr_hist[STAT_QUEUE], t - t_recv);
+    exec_message(udp_sock, UDP_BUF_ID, m, t_recv, t);
+    counters_write_begin(thr_ctr);
+    counters_add(thr_ctr, requests, 1);
+    counters_write_end(thr_ctr);
+  }
+
+  // replies the socket buffer cannot take are dropped, as on the network
+  unsigned long sent_bytes = 0;
+  trace_ev(TR_SEND_BEGIN, 0, udp_num_out);
+  int sent = udp_num_out > 0 ? sendmmsg(udp_sock, udp_out, udp_num_out, MSG_DONTWAIT) : 0;
+  if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("sendmmsg");
+  for (int i = 0; i < sent; i++)
+    sent_bytes += udp_out[i].msg_len;
+  trace_ev(TR_SEND_END, 0, sent_bytes);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_out, sent_bytes);
+  counters_write_end(thr_ctr);
+}
+
+// free the buffers of a closed conn, making bufs[buf_id] available
+void buf_release(int buf_id) {
+  free(bufs[buf_id].buf);
+  free(bufs[buf_id].reply_buf);
+  free(bufs[buf_id].fwd_buf);
+  free(bufs[buf_id].store_buf);
+
+  eventually_ignore_sys(pthread_mutex_lock(&bufs[buf_id].mtx), (per_client_thread == 1));
+  bufs[buf_id].buf = NULL;
+  bufs[buf_id].reply_buf = NULL;
+  bufs[buf_id].fwd_buf = NULL;
+  bufs[buf_id].store_buf = NULL;
+  eventually_ignore_sys(pthread_mutex_unlock(&bufs[buf_id].mtx), (per_client_thread == 1));
+}
+
+// Data received for the streamed message at the start of bufs[buf_id].buf,
+// at its curr_buf: write what its STORE is still due to storage
+void stream_consume(int buf_id, unsigned long len) {
+  buf_info *b = &bufs[buf_id];
+  unsigned long to_store = len < b->stream_store ? len : b->stream_store;
+  if (to_store > 0) {
+    store_write(buf_id, to_store);
+    b->stream_store -= to_store;
+  }
+}
+
+// Receive the next chunk of the streamed message, of at most
+// stream_left bytes not to touch the next message
+static inline void stream_next(int buf_id) {
+  buf_info *b = &bufs[buf_id];
+  unsigned long room = b->buf + b->buf_size - b->curr_buf;
+  b->curr_size = b->stream_left < room ? b->stream_left : room;
+}
+
+// The message at buf, of which msg_size bytes were received, is larger
+// than bufs[buf_id].buf: keep its header and cmds[] at the start of it,
+// and start streaming the rest; returns 0 if it cannot be streamed
+int stream_begin(int buf_id, unsigned char *buf, unsigned long msg_size) {
+  buf_info *b = &bufs[buf_id];
+  message_t *m = (message_t *) buf;
+  unsigned long hdr_size = sizeof(message_t) + m->num * sizeof(command_t);
+
+  if (num_backends > 0) {
+    fprintf(stderr, "Message of %u bytes too large to proxy, closing conn\n", m->req_size);
+    return 0;
+  }
+  memmove(b->buf, buf, msg_size);
+  m = (message_t *) b->buf;
+  cw_log("Streaming message of %u bytes, req_id=%u\n", m->req_size, m->req_id);
+  // its trailer would not be kept
+  m->flags &= ~MSG_TIMESTAMPS;
+  // the first STORE this node executes is written as the payload
+  // arrives, and what the payload is short of when it is executed
+  b->stream_store = 0;
+  for (int i = 0; storage_path && i < m->num && m->cmds[i].cmd != FORWARD && m->cmds[i].cmd != REPLY; i++)
+    if (m->cmds[i].cmd == STORE) {
+      b->stream_store = m->cmds[i].u.store_nbytes;
+      break;
+    }
+  b->stream_stored = (b->stream_store > 0);
+  b->stream_left = m->req_size - msg_size;
+  b->curr_buf = b->buf + hdr_size;
+  stream_consume(buf_id, msg_size - hdr_size);
+  stream_next(buf_id);
+  return 1;
+}
+
+// received bytes of the streamed message of bufs[buf_id] arrived,
+// executing it once complete
+void stream_recv(int sock, int buf_id, unsigned long received, uint64_t t_recv) {
+  buf_info *b = &bufs[buf_id];
+  message_t *m = (message_t *) b->buf;
+
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_in, received);
+  counters_write_end(thr_ctr);
+  stream_consume(buf_id, received);
+  b->stream_left -= received;
+  if (b->stream_left > 0) {
+    stream_next(buf_id);
+    return;
+  }
+
+  trace_ev(TR_PARSE, m->req_id, m->req_size);
+  uint64_t t = now_ns();
+  hist_add(&thr_hist[STAT_QUEUE], t - t_recv);
+  exec_message(sock, buf_id, m, t_recv, t);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, requests, 1);
+  counters_write_end(thr_ctr);
+  b->curr_buf = b->buf;
+  b->curr_size = b->buf_size;
+}
+
 int process_messages(int sock, int buf_id) {
-  size_t received = recv(sock, bufs[buf_id].curr_buf, bufs[buf_id].curr_size, 0);
+  size_t received = conn_recv(sock, buf_id, bufs[buf_id].curr_buf, bufs[buf_id].curr_size);
   cw_log("recv() returned: %d\n", (int)received);
   if (received == 0) {
     cw_log("Connection closed by remote end\n");
-    free(bufs[buf_id].buf);
-    free(bufs[buf_id].reply_buf);
-    free(bufs[buf_id].fwd_buf);
-    free(bufs[buf_id].store_buf);
-
-    eventually_ignore_sys(pthread_mutex_lock(&bufs[buf_id].mtx), (per_client_thread == 1));
-    bufs[buf_id].buf = NULL;
-    bufs[buf_id].reply_buf = NULL;
-    eventually_ignore_sys(pthread_mutex_unlock(&bufs[buf_id].mtx), (per_client_thread == 1));
-
+    buf_release(buf_id);
     return 0;
   } else if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
     cw_log("Got EAGAIN or EWOULDBLOCK, ignoring...\n");
@@ -331,13 +1323,22 @@ int process_messages(int sock, int buf_id) {
     fprintf(stderr, "Unexpected error: %s\n", strerror(errno));
     return 0;
   }
+  uint64_t t_recv = now_ns();
+  trace_ev(TR_RECV, 0, received);
+  if (bufs[buf_id].stream_left > 0) {
+    stream_recv(sock, buf_id, received, t_recv);
+    return 1;
+  }
   bufs[buf_id].curr_buf += received;
   bufs[buf_id].curr_size -= received;
 
   unsigned char *buf = bufs[buf_id].buf;
   unsigned long msg_size = bufs[buf_id].curr_buf - buf;
 
-  ssize_t data = -1;
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, bytes_in, received);
+  counters_set(thr_ctr, queue_depth, count_messages(buf, msg_size));
+  counters_write_end(thr_ctr);
 
   // batch processing of multiple messages, if received more than 1
   do {
@@ -348,36 +1349,40 @@ int process_messages(int sock, int buf_id) {
     }
     message_t *m = (message_t *) buf;
     cw_log("Received %lu bytes, req_id=%u, req_size=%u, num=%d\n", msg_size, m->req_id, m->req_size, m->num);
+    assert(m->req_size >= sizeof(message_t));
+    if (m->req_size > bufs[buf_id].buf_size && msg_size >= sizeof(message_t) + m->num * sizeof(command_t)) {
+      if (!stream_begin(buf_id, buf, msg_size)) {
+        buf_release(buf_id);
+        return 0;
+      }
+      return 1;
+    }
     if (msg_size < m->req_size) {
       cw_log("Got header but incomplete message, need to recv() more...\n");
       break;
     }
-    assert(m->req_size >= sizeof(message_t) && m->req_size <= BUF_SIZE);
-    for (int i = 0; i < m->num; i++) {
-      if (m->cmds[i].cmd == COMPUTE) {
-	compute_for(m->cmds[i].u.comp_time_us);
-      } else if (m->cmds[i].cmd == FORWARD) {
-	forward(buf_id, m, i);
-	// rest of cmds[] are for next hop, not me
-	break;
-      } else if (m->cmds[i].cmd == REPLY) {
-        //simulate data retrieve
-	if (data >= 0) {
-          m->cmds[i].u.fwd.pkt_size += data;
-	  data = -1;
-	}
-	reply(sock, buf_id, m, i);
-	// any further cmds[] for replied-to hop, not me
-	break;
-      } else if (m->cmds[i].cmd == STORE && storage_path) {
-        store(buf_id, m->cmds[i].u.store_nbytes);
-      } else if (m->cmds[i].cmd == LOAD && storage_path) {
-        data = load(m->cmds[i].u.load_nbytes);
-      } else {
-	cw_log("Unknown cmd: %d\n", m->cmds[0].cmd);
-	exit(EXIT_FAILURE);
+    trace_ev(TR_PARSE, m->req_id, m->req_size);
+    // t tracks the end of the previous step, to time the next one
+    uint64_t t = now_ns();
+    hist_add(&thr_hist[STAT_QUEUE], t - t_recv);
+    // STATS requests are served by the proxy itself
+    if (num_backends > 0 && !(m->num > 0 && m->cmds[0].cmd == STATS)) {
+      if (!proxy_reply_fits(m)) {
+        fprintf(stderr, "Reply to req %u too large to proxy, closing conn\n", m->req_id);
+        buf_release(buf_id);
+        return 0;
       }
-    }
+      if (!proxy_relay(buf_id, m)) {
+        buf_release(buf_id);
+        return 0;
+      }
+    } else
+      exec_message(sock, buf_id, m, t_recv, t);
+
+    counters_write_begin(thr_ctr);
+    counters_add(thr_ctr, requests, 1);
+    counters_add(thr_ctr, queue_depth, -1);
+    counters_write_end(thr_ctr);
 
     // move to batch processing of next message if any
     buf += m->req_size;
@@ -445,14 +1450,111 @@ void setnonblocking(int fd) {
 }
 
 
+// Map the rings passed by the client over the Unix domain socket of
+// bufs[buf_id], returning -1 on failure
+int shm_conn_setup(int buf_id) {
+  buf_info *b = &bufs[buf_id];
+  int fds[SHM_FD_NUM];
+  struct stat st;
+
+  if (shm_recv_fds(b->sock, fds) < 0) {
+    fprintf(stderr, "Could not receive shm fds\n");
+    return -1;
+  }
+  sys_check(fstat(fds[SHM_FD_MEM], &st));
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_MEM], 0);
+  check(map != MAP_FAILED);
+  close(fds[SHM_FD_MEM]);
+  uint32_t ring_size = ((shm_ring_t *) map)->size;
+  if (ring_size == 0 || (ring_size & (ring_size - 1)) || shm_map_size(ring_size) != st.st_size) {
+    fprintf(stderr, "Malformed shm of %ld bytes\n", (long) st.st_size);
+    munmap(map, st.st_size);
+    close(fds[SHM_FD_TO_NODE]);
+    close(fds[SHM_FD_TO_CLIENT]);
+    return -1;
+  }
+  b->shm_map = map;
+  b->shm_map_size = st.st_size;
+  b->shm_rx = shm_ring_get(map, ring_size, SHM_RING_REQ);
+  b->shm_tx = shm_ring_get(map, ring_size, SHM_RING_REPLY);
+  b->shm_efd_in = fds[SHM_FD_TO_NODE];
+  b->shm_efd_out = fds[SHM_FD_TO_CLIENT];
+  setnonblocking(b->shm_efd_in);
+  cw_log("Conn %d uses shm rings of %u bytes\n", buf_id, ring_size);
+  return 0;
+}
+
+void shm_conn_close(int epollfd, int buf_id) {
+  buf_info *b = &bufs[buf_id];
+  cw_log("Shm conn %d closed by remote end\n", buf_id);
+  sys_check(epoll_ctl(epollfd, EPOLL_CTL_DEL, b->shm_efd_in, NULL));
+  close(b->shm_efd_in);
+  close(b->shm_efd_out);
+  munmap(b->shm_map, b->shm_map_size);
+  b->shm_rx = b->shm_tx = NULL;
+  buf_release(buf_id);
+  close_and_forget(epollfd, b->sock);
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, conns_closed, 1);
+  counters_write_end(thr_ctr);
+}
+
+// Eventfd of a shm conn signaled: process messages until its ring is
+// empty, polling it for up to shm_spin_us before going back to sleep
+void shm_process(int buf_id) {
+  buf_info *b = &bufs[buf_id];
+  eventfd_t cnt;
+  eventfd_read(b->shm_efd_in, &cnt);
+  for (;;) {
+    while (shm_ring_readable(b->shm_rx) > 0) {
+      if (!process_messages(b->sock, buf_id)) {
+        // released the conn: wake up shm_conn_close() through its socket
+        b->shm_rx = NULL;
+        shutdown(b->sock, SHUT_RDWR);
+        return;
+      }
+    }
+    if (shm_spin_us > 0) {
+      uint64_t t_end = now_ns() + shm_spin_us * 1000;
+      while (shm_ring_readable(b->shm_rx) == 0 && now_ns() < t_end)
+        cpu_relax();
+      if (shm_ring_readable(b->shm_rx) > 0)
+        continue;
+    }
+    if (shm_ring_cons_wait(b->shm_rx))
+      return;
+  }
+}
+
 void exec_request(int epollfd, struct epoll_event ev) {
   int buf_id = ev.data.u32;
-  
+
+  if (ev.data.u32 & PCONN_TAG) {
+    proxy_recv(ev.data.u32 & ~PCONN_TAG);
+    return;
+  }
+
+  if (ev.data.u32 & SHM_SOCK_TAG) {
+    shm_conn_close(epollfd, ev.data.u32 & ~SHM_SOCK_TAG);
+    return;
+  }
+
+  if (bufs[buf_id].shm_rx != NULL) {
+    shm_process(buf_id);
+    return;
+  } else if (bufs[buf_id].buf == NULL) {
+    // stale event of a shm conn closed meanwhile
+    return;
+  }
+
   if ((ev.events | EPOLLIN) && bufs[buf_id].status == RECEIVING) {
     int ret = process_messages(bufs[buf_id].sock, buf_id);
 
     if (!ret) {
       close_and_forget(epollfd, bufs[buf_id].sock);
+      counters_write_begin(thr_ctr);
+      counters_add(thr_ctr, conns_closed, 1);
+      counters_write_end(thr_ctr);
     }
   } else if ((ev.events | EPOLLOUT) && bufs[buf_id].status == SENDING)
     send_messages(buf_id);
@@ -469,21 +1571,28 @@ void * epoll_worker_loop(void * args) {
   struct epoll_event ev;
   int worker_running = 1;
 
+  // leave signals to the main thread
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGUSR1);
+  sys_check(pthread_sigmask(SIG_BLOCK, &sigs, NULL));
+
+  node_thread_init(1 + (infos - thread_infos));
+  thr_epollfd = infos->epollfd;
+
   // Add terminationfd
   ev.events = EPOLLIN;
   ev.data.fd = infos -> terminationfd;
   sys_check(epoll_ctl(infos -> epollfd, EPOLL_CTL_ADD, infos -> terminationfd, & ev));
 
   while (worker_running) {
-    int nfds = epoll_wait(infos -> epollfd, infos -> events, MAX_EVENTS, -1);
+    int nfds = reactor_wait(infos -> epollfd, infos -> events, MAX_EVENTS);
     if (nfds == -1) {
+      if (errno == EINTR)
+        continue;
       perror("epoll_wait");
-
-      if (errno == EINTR) {
-        worker_running = 0;
-      } else {
-        exit(EXIT_FAILURE);
-      }
+      exit(EXIT_FAILURE);
     }
 
     for (int i = 0; i < nfds; i++) {
@@ -496,9 +1605,246 @@ void * epoll_worker_loop(void * args) {
     }
   }
 
+  node_thread_exit();
   return (void * ) 1;
 }
 
+// Close a conn that could not be set up, before it was added to epoll
+void conn_reject(int conn_sock) {
+  sock_del(conn_sock);
+  close(conn_sock);
+}
+
+// Set up the conn just accepted, of the TCP (addr being its peer), Unix
+// domain or shm listening socket, handing it to its own thread with
+// --per-client-thread; called by the main thread and by acceptors
+void accept_conn(int conn_sock, struct sockaddr_in *addr, int is_tcp, int is_shm) {
+  struct epoll_event ev;
+
+  // only TCP conns can be reached by FORWARD
+  int orig_sock_id = -1;
+  if (is_tcp) {
+    cw_log("Accepted connection from: %s:%d\n", inet_ntoa(addr->sin_addr), addr->sin_port);
+    //setnonblocking(conn_sock);
+    int val = 1;
+    sys_check(setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (void * ) & val, sizeof(val)));
+    busy_poll_sock(conn_sock);
+
+    orig_sock_id = sock_add(addr->sin_addr.s_addr, addr->sin_port, conn_sock);
+    if (orig_sock_id == -1) {
+      fprintf(stderr, "Not enough sockets for new connection, closing!\n");
+      close(conn_sock);
+      return;
+    }
+  } else {
+    cw_log("Accepted local connection on %s\n", is_shm ? shm_path : unix_path);
+  }
+
+  unsigned char * new_buf = 0;
+  unsigned char * new_reply_buf = 0;
+  unsigned char * new_fwd_buf = 0;
+  unsigned char * new_store_buf = 0;
+
+  new_buf = malloc(BUF_SIZE);
+  new_reply_buf = malloc(BUF_SIZE);
+  new_fwd_buf = malloc(BUF_SIZE);
+
+  if (storage_path)
+    new_store_buf = (use_odirect ? aligned_alloc(blk_size, BUF_SIZE + blk_size) : malloc(BUF_SIZE));
+
+  if (new_buf == 0 || new_reply_buf == 0 || new_fwd_buf == 0 || (storage_path && new_store_buf == 0)) {
+    conn_reject(conn_sock);
+    goto continue_free;
+  }
+
+  int buf_id;
+  for (buf_id = 0; buf_id < MAX_BUFFERS; buf_id++) {
+    eventually_ignore_sys(pthread_mutex_lock(&bufs[buf_id].mtx), (per_client_thread == 1));
+    if (bufs[buf_id].buf == 0) {
+      break; //unlock mutex above after mallocs
+    }
+    eventually_ignore_sys(pthread_mutex_unlock(&bufs[buf_id].mtx), (per_client_thread == 1));
+  }
+  if (buf_id == MAX_BUFFERS) {
+    fprintf(stderr, "Not enough buffers for new connection, closing!\n");
+    conn_reject(conn_sock);
+    goto continue_free;
+  }
+  bufs[buf_id].buf = new_buf;
+  bufs[buf_id].reply_buf = new_reply_buf;
+  bufs[buf_id].fwd_buf = new_fwd_buf;
+  if (storage_path)
+    bufs[buf_id].store_buf = new_store_buf;
+
+  eventually_ignore_sys(pthread_mutex_unlock(&bufs[buf_id].mtx), (per_client_thread == 1));
+
+  // From here, safe to assume that bufs[buf_id] is thread-safe
+  cw_log("Connection assigned to worker %d\n", buf_id);
+  bufs[buf_id].buf_size = BUF_SIZE;
+  bufs[buf_id].curr_buf = bufs[buf_id].buf;
+  bufs[buf_id].curr_size = BUF_SIZE;
+  bufs[buf_id].sock = conn_sock;
+  bufs[buf_id].status = RECEIVING;
+  bufs[buf_id].stream_left = bufs[buf_id].stream_store = 0;
+  bufs[buf_id].stream_stored = 0;
+  bufs[buf_id].orig_sock_id = orig_sock_id;
+  bufs[buf_id].conn_id = __atomic_fetch_add(&next_conn_id, 1, __ATOMIC_RELAXED);
+
+  int conn_epollfd = per_client_thread ? thread_infos[buf_id].epollfd : epollfd;
+  if (is_shm) {
+    if (shm_conn_setup(buf_id) < 0) {
+      buf_release(buf_id);
+      conn_reject(conn_sock);
+      return;
+    }
+    // requests are notified on the eventfd, the socket only tells the conn is over
+    ev.events = EPOLLIN;
+    ev.data.u32 = buf_id;
+    sys_check(epoll_ctl(conn_epollfd, EPOLL_CTL_ADD, bufs[buf_id].shm_efd_in, &ev));
+    ev.data.u32 = SHM_SOCK_TAG | buf_id;
+    sys_check(epoll_ctl(conn_epollfd, EPOLL_CTL_ADD, conn_sock, &ev));
+    counters_write_begin(thr_ctr);
+    counters_add(thr_ctr, conns_opened, 1);
+    counters_write_end(thr_ctr);
+    return;
+  }
+
+  // sockets are blocking, and no status other than RECEIVING is
+  // used: waiting for EPOLLOUT too would make a thread block in
+  // recv() on a writable but idle conn, instead of serving the
+  // other ones (or the replies of backends with --proxy)
+  ev.events = EPOLLIN;
+  // Use the data.u32 field to store the buf_id in bufs[]
+  ev.data.u32 = buf_id;
+
+  //add client fd
+  if (per_client_thread){
+    //to the worker epoll
+    //(which, at this point, is already up and running)
+    sys_check(epoll_ctl(thread_infos[buf_id].epollfd, EPOLL_CTL_ADD, conn_sock, & ev));
+  } else { //to main thread
+    sys_check(epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock, &ev));
+  }
+
+  counters_write_begin(thr_ctr);
+  counters_add(thr_ctr, conns_opened, 1);
+  counters_write_end(thr_ctr);
+
+  return;
+
+  continue_free:
+
+  if (new_buf)
+    free(new_buf);
+  if (new_reply_buf)
+    free(new_reply_buf);
+  if (new_fwd_buf)
+    free(new_fwd_buf);
+  if (storage_path && new_store_buf)
+    free(new_store_buf);
+}
+
+// Accept all pending conns of the non-blocking listening socket lsock,
+// so that a burst of them costs a single epoll wake-up
+void accept_conns(int lsock, int is_tcp, int is_shm) {
+  for (;;) {
+    struct sockaddr_in addr;
+    socklen_t addr_size = sizeof(addr);
+    int conn_sock = accept4(lsock, is_tcp ? (struct sockaddr *) &addr : NULL, is_tcp ? &addr_size : NULL, SOCK_CLOEXEC);
+    if (conn_sock == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      // conn reset before being accepted
+      if (errno == ECONNABORTED || errno == EPROTO || errno == EINTR)
+        continue;
+      perror("accept");
+      exit(EXIT_FAILURE);
+    }
+    accept_conn(conn_sock, &addr, is_tcp, is_shm);
+  }
+}
+
+// Acceptor threads (--acceptors n, with --per-client-thread): acceptor
+// i > 0 accepts conns on listen_socks[i], the main thread on
+// listen_socks[0], the kernel spreading new conns across them
+// (SO_REUSEPORT), by the CPU they arrive on with --reuseport-cbpf
+void *acceptor_loop(void *args) {
+  int i = (intptr_t) args;
+  struct epoll_event ev, events[MAX_EVENTS];
+  int running = 1;
+
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGUSR1);
+  sys_check(pthread_sigmask(SIG_BLOCK, &sigs, NULL));
+
+  node_thread_init(MAX_BUFFERS + i);
+  if (reuseport_cbpf) {
+    // the CPUs whose conns the filter steers to listen_socks[i]
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int c = i; c < ncpus && c < CPU_SETSIZE; c += acceptors)
+      CPU_SET(c, &cpus);
+    if (CPU_COUNT(&cpus) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      fprintf(stderr, "Warning: could not pin acceptor %d\n", i);
+  }
+
+  int epfd;
+  sys_check(epfd = epoll_create1(0));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_socks[i];
+  sys_check(epoll_ctl(epfd, EPOLL_CTL_ADD, listen_socks[i], &ev));
+  ev.data.fd = acceptor_infos[i].terminationfd;
+  sys_check(epoll_ctl(epfd, EPOLL_CTL_ADD, acceptor_infos[i].terminationfd, &ev));
+
+  while (running) {
+    int nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (nfds == -1 && errno == EINTR)
+      continue;
+    sys_check(nfds);
+    for (int j = 0; j < nfds; j++) {
+      if (events[j].data.fd == acceptor_infos[i].terminationfd)
+        running = 0;
+      else
+        accept_conns(listen_socks[i], 1, 0);
+    }
+  }
+  close(epfd);
+  node_thread_exit();
+  return NULL;
+}
+
+// listening TCP socket bound to addr, joining the SO_REUSEPORT group
+// of the other acceptors, if any
+int tcp_listen(struct sockaddr_in *addr) {
+  int sock, val = 1;
+
+  sys_check(sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+  sys_check(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&val, sizeof(val)));
+  // only among acceptors, not to share the port with another node by mistake
+  if (acceptors > 1)
+    sys_check(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&val, sizeof(val)));
+  if (tcp_fastopen > 0)
+    sys_check(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, (void *)&tcp_fastopen, sizeof(tcp_fastopen)));
+  sys_check(bind(sock, (struct sockaddr *) addr, sizeof(*addr)));
+  sys_check(listen(sock, listen_backlog));
+  return sock;
+}
+
+// steer each new conn to listen_socks[cpu % acceptors], cpu being the
+// one it arrived on
+void reuseport_attach_cbpf() {
+  struct sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, acceptors },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+  sys_check(setsockopt(listen_socks[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)));
+}
+
 void epoll_main_loop(int listen_sock) {
   struct epoll_event ev, events[MAX_EVENTS];
 
@@ -510,6 +1856,8 @@ void epoll_main_loop(int listen_sock) {
     perror("epoll_create1");
     exit(EXIT_FAILURE);
   }
+  thr_epollfd = epollfd;
+  busy_poll_epoll(epollfd);
 
   ev.events = EPOLLIN;
   ev.data.fd = -1; // Special value denoting listen_sock
@@ -518,111 +1866,44 @@ void epoll_main_loop(int listen_sock) {
     exit(EXIT_FAILURE);
   }
 
+  if (udp) {
+    ev.events = EPOLLIN;
+    ev.data.fd = -2; // Special value denoting udp_sock
+    sys_check(epoll_ctl(epollfd, EPOLL_CTL_ADD, udp_sock, &ev));
+  }
+
+  if (unix_sock != -1) {
+    ev.events = EPOLLIN;
+    ev.data.fd = -3; // Special value denoting unix_sock
+    sys_check(epoll_ctl(epollfd, EPOLL_CTL_ADD, unix_sock, &ev));
+  }
+
+  if (shm_sock != -1) {
+    ev.events = EPOLLIN;
+    ev.data.fd = -4; // Special value denoting shm_sock
+    sys_check(epoll_ctl(epollfd, EPOLL_CTL_ADD, shm_sock, &ev));
+  }
+
   while (node_running) {
     cw_log("epoll_wait()ing...\n");
-    int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+    int nfds = reactor_wait(epollfd, events, MAX_EVENTS);
     if (nfds == -1) {
+      // signals (SIGINT clears node_running)
+      if (errno == EINTR)
+        continue;
       perror("epoll_wait");
-
-      if (errno == EINTR) {
-        node_running = 0;
-      } else {
-        exit(EXIT_FAILURE);
-      }
+      exit(EXIT_FAILURE);
     }
 
     for (int i = 0; i < nfds; i++) {
       if (events[i].data.fd == -1) {
-        struct sockaddr_in addr;
-        socklen_t addr_size = sizeof(addr);
-        int conn_sock = accept(listen_sock,
-          (struct sockaddr * ) & addr, & addr_size);
-
-        if (conn_sock == -1) {
-          perror("accept");
-          exit(EXIT_FAILURE);
-        }
-
-        cw_log("Accepted connection from: %s:%d\n", inet_ntoa(addr.sin_addr), addr.sin_port);
-        //setnonblocking(conn_sock);
-        int val = 1;
-        sys_check(setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (void * ) & val, sizeof(val)));
-
-        int orig_sock_id = sock_add(addr.sin_addr.s_addr, addr.sin_port, conn_sock);
-        check(orig_sock_id != -1);
-        
-        unsigned char * new_buf = 0;
-        unsigned char * new_reply_buf = 0;
-        unsigned char * new_fwd_buf = 0;
-        unsigned char * new_store_buf = 0;
-
-        new_buf = malloc(BUF_SIZE);
-        new_reply_buf = malloc(BUF_SIZE);
-        new_fwd_buf = malloc(BUF_SIZE);
-
-        if (storage_path)
-          new_store_buf = (use_odirect ? aligned_alloc(blk_size, BUF_SIZE + blk_size) : malloc(BUF_SIZE));
-
-        if (new_buf == 0 || new_reply_buf == 0 || new_fwd_buf == 0 || (storage_path && new_store_buf == 0)) {
-          close_and_forget(epollfd, conn_sock);
-          goto continue_free;
-        }
-
-        int buf_id;
-        for (buf_id = 0; buf_id < MAX_BUFFERS; buf_id++) {
-          eventually_ignore_sys(pthread_mutex_lock(&bufs[buf_id].mtx), (per_client_thread == 1));
-          if (bufs[buf_id].buf == 0) {
-            break; //unlock mutex above after mallocs
-          }
-          eventually_ignore_sys(pthread_mutex_unlock(&bufs[buf_id].mtx), (per_client_thread == 1));
-        }
-        if (buf_id == MAX_BUFFERS) {
-          fprintf(stderr, "Not enough buffers for new connection, closing!\n");
-          close_and_forget(epollfd, conn_sock);
-          goto continue_free;
-        }
-        bufs[buf_id].buf = new_buf;
-        bufs[buf_id].reply_buf = new_reply_buf;
-        bufs[buf_id].fwd_buf = new_fwd_buf;
-        if (storage_path)
-          bufs[buf_id].store_buf = new_store_buf;
-        
-        eventually_ignore_sys(pthread_mutex_unlock(&bufs[buf_id].mtx), (per_client_thread == 1));
-
-        // From here, safe to assume that bufs[buf_id] is thread-safe
-        cw_log("Connection assigned to worker %d\n", buf_id);
-        bufs[buf_id].buf_size = BUF_SIZE;
-        bufs[buf_id].curr_buf = bufs[buf_id].buf;
-        bufs[buf_id].curr_size = BUF_SIZE;
-        bufs[buf_id].sock = conn_sock;
-        bufs[buf_id].status = RECEIVING;
-        bufs[buf_id].orig_sock_id = orig_sock_id;
-
-        ev.events = EPOLLIN | EPOLLOUT;
-        // Use the data.u32 field to store the buf_id in bufs[]
-        ev.data.u32 = buf_id;
-
-        //add client fd
-        if (per_client_thread){
-          //to the worker epoll
-          //(which, at this point, is already up and running)
-          sys_check(epoll_ctl(thread_infos[buf_id].epollfd, EPOLL_CTL_ADD, conn_sock, & ev));
-        } else { //to main thread
-          sys_check(epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock, &ev));
-        }
-
-        continue;
-
-        continue_free:
-
-        if (new_buf)
-          free(new_buf);
-        if (new_reply_buf)
-          free(new_reply_buf);
-        if (new_fwd_buf)
-          free(new_fwd_buf);
-        if (storage_path && new_store_buf)
-          free(new_store_buf);
+        accept_conns(listen_sock, 1, 0);
+      } else if (events[i].data.fd == -3) {
+        accept_conns(unix_sock, 0, 0);
+      } else if (events[i].data.fd == -4) {
+        accept_conns(shm_sock, 0, 1);
+      } else if (events[i].data.fd == -2) {
+        udp_process();
       } else { //NOTE: unused if --per-client-thread
         exec_request(epollfd, events[i]);
       }
@@ -630,14 +1911,28 @@ void epoll_main_loop(int listen_sock) {
   }
 }
 
+// listening Unix domain stream socket bound to path
+int unix_listen(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int sock;
+
+  check(strlen(path) < sizeof(addr.sun_path));
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  sys_check(sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+  sys_check(bind(sock, (struct sockaddr *) &addr, sizeof(addr)));
+  sys_check(listen(sock, listen_backlog));
+  cw_log("Accepting local connections on %s\n", path);
+  return sock;
+}
+
 int main(int argc, char *argv[]) {
-  int welcomeSocket;
   struct sockaddr_in serverAddr;
 
   argc--;  argv++;
   while (argc > 0) {
     if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
-      printf("Usage: dw_node [-h|--help] [-b bindname] [-bp bindport] [-s|--storage path/to/storage/file] [--per-client-thread] [--odirect]\n");
+      printf("Usage: dw_node [-h|--help] [-b bindname] [-bp bindport] [-s|--storage path/to/storage/file] [--per-client-thread] [--odirect] [--shm-counters] [--trace trace.bin] [--trace-size events] [--perf-events] [--proxy host:port[,host:port...]] [--proxy-policy lo|ewma|p2c] [--proxy-conns n] [--udp] [--unix path] [--shm path] [--shm-spin us] [--busy-poll us] [--backlog n] [--acceptors n] [--reuseport-cbpf] [--tcp-fastopen qlen]\n");
       exit(EXIT_SUCCESS);
     } else if (strcmp(argv[0], "-b") == 0) {
       assert(argc >= 2);
@@ -659,6 +1954,83 @@ int main(int argc, char *argv[]) {
       per_client_thread = 1;
     } else if (strcmp(argv[0], "--odirect") == 0) {
       use_odirect = 1;
+    } else if (strcmp(argv[0], "--shm-counters") == 0) {
+      shm_counters = 1;
+    } else if (strcmp(argv[0], "--perf-events") == 0) {
+      perf_events = 1;
+    } else if (strcmp(argv[0], "--udp") == 0) {
+      udp = 1;
+    } else if (strcmp(argv[0], "--unix") == 0) {
+      assert(argc >= 2);
+      unix_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--shm") == 0) {
+      assert(argc >= 2);
+      shm_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--backlog") == 0) {
+      assert(argc >= 2);
+      listen_backlog = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--acceptors") == 0) {
+      assert(argc >= 2);
+      acceptors = atoi(argv[1]);
+      check(acceptors >= 1 && acceptors <= MAX_ACCEPTORS);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--reuseport-cbpf") == 0) {
+      reuseport_cbpf = 1;
+    } else if (strcmp(argv[0], "--tcp-fastopen") == 0) {
+      assert(argc >= 2);
+      tcp_fastopen = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--busy-poll") == 0) {
+      assert(argc >= 2);
+      busy_poll_us = strtoul(argv[1], NULL, 10);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--shm-spin") == 0) {
+      assert(argc >= 2);
+      shm_spin_us = strtoul(argv[1], NULL, 10);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--proxy") == 0) {
+      assert(argc >= 2);
+      char *save, *tok;
+      for (tok = strtok_r(argv[1], ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        check(num_backends < MAX_BACKENDS);
+        char *colon = strrchr(tok, ':');
+        backends[num_backends].host = tok;
+        backends[num_backends].port = 7891;
+        if (colon != NULL) {
+          *colon = '\0';
+          backends[num_backends].port = atoi(colon + 1);
+        }
+        num_backends++;
+      }
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--proxy-policy") == 0) {
+      assert(argc >= 2);
+      int p;
+      for (p = 0; p < sizeof(proxy_policy_names) / sizeof(proxy_policy_names[0]); p++)
+        if (strcmp(argv[1], proxy_policy_names[p]) == 0)
+          break;
+      if (p == sizeof(proxy_policy_names) / sizeof(proxy_policy_names[0])) {
+        printf("Unknown proxy policy: %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+      }
+      proxy_policy = p;
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--proxy-conns") == 0) {
+      assert(argc >= 2);
+      proxy_conns = atoi(argv[1]);
+      check(proxy_conns >= 1);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--trace") == 0) {
+      assert(argc >= 2);
+      trace_path = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "--trace-size") == 0) {
+      assert(argc >= 2);
+      trace_size = atol(argv[1]);
+      argc--;  argv++;
     } else {
       printf("Unrecognized option: %s\n", argv[0]);
       exit(EXIT_FAILURE);
@@ -669,6 +2041,18 @@ int main(int argc, char *argv[]) {
   //Setup SIGINT signal handler
   signal(SIGINT, sigint_cleanup);
 
+  if (shm_counters)
+    shm_counters_init();
+
+  // Trace events in memory, dumped on SIGUSR1 and at exit
+  if (trace_path) {
+    trace_init(trace_path, trace_size, MAX_STATS_SLOTS);
+    signal(SIGUSR1, sigusr1_trace_dump);
+  }
+
+  node_thread_init(0);
+  node_stats_start_ns = now_ns();
+
   // Tag all buf_info as unused
   for (int i = 0; i < MAX_BUFFERS; i++) {
     bufs[i].buf = 0;
@@ -684,6 +2068,7 @@ int main(int argc, char *argv[]) {
     for (int i = 0; i < MAX_BUFFERS; i++) {
       thread_infos[i].terminationfd = eventfd(0, 0);  
       sys_check(thread_infos[i].epollfd = epoll_create1(0));
+      busy_poll_epoll(thread_infos[i].epollfd);
       sys_check(pthread_create(&workers[i], NULL, epoll_worker_loop, (void*) &thread_infos[i]));
     }
 
@@ -702,6 +2087,15 @@ int main(int argc, char *argv[]) {
     sys_check(pthread_mutex_init(&socks_mtx, &attr));
   }
 
+  for (int b = 0; b < num_backends; b++) {
+    struct hostent *e = gethostbyname(backends[b].host);
+    check(e != NULL);
+    backends[b].addr.sin_family = AF_INET;
+    memcpy(&backends[b].addr.sin_addr.s_addr, e->h_addr, e->h_length);
+    backends[b].addr.sin_port = htons(backends[b].port);
+    cw_log("Proxying to backend %s:%d\n", backends[b].host, backends[b].port);
+  }
+
   // Open storage file, if any
   if (storage_path) {
     int flags = O_RDWR | O_CREAT | O_TRUNC;
@@ -714,14 +2108,6 @@ int main(int argc, char *argv[]) {
     cw_log("blk_size = %lu\n", blk_size);
   }
 
-  /*---- Create the socket. The three arguments are: ----*/
-  /* 1) Internet domain 2) Stream socket 3) Default protocol (TCP in this case) */
-  welcomeSocket = socket(PF_INET, SOCK_STREAM, 0);
-
-  int val = 1;
-  setsockopt(welcomeSocket, IPPROTO_TCP, SO_REUSEADDR, (void *)&val, sizeof(val));
-  setsockopt(welcomeSocket, IPPROTO_TCP, SO_REUSEPORT, (void *)&val, sizeof(val));
-
   /*---- Configure settings of the server address struct ----*/
   /* Address family = Internet */
   serverAddr.sin_family = AF_INET;
@@ -732,16 +2118,56 @@ int main(int argc, char *argv[]) {
   /* Set all bits of the padding field to 0 */
   memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);  
 
-  /*---- Bind the address struct to the socket ----*/
-  sys_check(bind(welcomeSocket, (struct sockaddr *) &serverAddr, sizeof(serverAddr)));
+  /*---- Bind a listening socket per acceptor ----*/
+  // acceptors hand conns over to per-client threads, otherwise the
+  // main thread serves them all anyway
+  check(acceptors == 1 || per_client_thread);
+  for (int i = 0; i < acceptors; i++)
+    listen_socks[i] = tcp_listen(&serverAddr);
+  if (reuseport_cbpf && acceptors > 1)
+    reuseport_attach_cbpf();
+
+  if (udp) {
+    // replies are relayed over the connections requests come from
+    check(num_backends == 0);
+    sys_check(udp_sock = socket(PF_INET, SOCK_DGRAM, 0));
+    sys_check(bind(udp_sock, (struct sockaddr *) &serverAddr, sizeof(serverAddr)));
+    busy_poll_sock(udp_sock);
+    bufs[UDP_BUF_ID].buf = malloc(UDP_BATCH * UDP_MAX_SIZE);
+    bufs[UDP_BUF_ID].reply_buf = malloc(BUF_SIZE);
+    bufs[UDP_BUF_ID].fwd_buf = malloc(BUF_SIZE);
+    udp_out_buf = malloc(UDP_BATCH * UDP_MAX_SIZE);
+    check(bufs[UDP_BUF_ID].buf != NULL && bufs[UDP_BUF_ID].reply_buf != NULL
+          && bufs[UDP_BUF_ID].fwd_buf != NULL && udp_out_buf != NULL);
+    if (storage_path) {
+      bufs[UDP_BUF_ID].store_buf = (use_odirect ? aligned_alloc(blk_size, BUF_SIZE + blk_size) : malloc(BUF_SIZE));
+      check(bufs[UDP_BUF_ID].store_buf != NULL);
+    }
+    cw_log("Accepting UDP messages too\n");
+  }
 
-  /*---- Listen on the socket, with 5 max connection requests queued ----*/
-  sys_check(listen(welcomeSocket, 5));
+  if (unix_path)
+    unix_sock = unix_listen(unix_path);
+  if (shm_path)
+    shm_sock = unix_listen(shm_path);
   cw_log("Accepting new connections...\n");
 
-  epoll_main_loop(welcomeSocket);
+  for (int i = 1; i < acceptors; i++) {
+    sys_check(acceptor_infos[i].terminationfd = eventfd(0, 0));
+    sys_check(pthread_create(&acceptor_threads[i], NULL, acceptor_loop, (void *) (intptr_t) i));
+  }
+
+  epoll_main_loop(listen_socks[0]);
+  node_thread_exit();
 
   //Clean-ups
+  for (int i = 1; i < acceptors; i++) {
+    sys_check(pthread_join(acceptor_threads[i], NULL));
+    close(acceptor_infos[i].terminationfd);
+  }
+  for (int i = 0; i < acceptors; i++)
+    close(listen_socks[i]);
+
   if (per_client_thread) {
     //Join worker threads
     for (int i = 0; i < MAX_BUFFERS; i++) {
@@ -761,6 +2187,16 @@ int main(int argc, char *argv[]) {
   if (storage_fd >= 0) {
     close(storage_fd);
   }
+
+  if (shm_counters)
+    shm_counters_cleanup();
+
+  if (unix_path)
+    unlink(unix_path);
+  if (shm_path)
+    unlink(shm_path);
+
+  trace_dump();
   
   return 0;
 }
@@ -0,0 +1,133 @@
+#include "counters.h"
+#include "timespec.h"
+#include "cw_debug.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+// Sum of the counters of all node threads
+void sample(node_counters_t *nc, thread_counters_t *tot, thread_counters_t *thr) {
+  memset(tot, 0, sizeof(*tot));
+  for (int i = 0; i < nc->num_threads; i++) {
+    counters_read(&nc->thr[i], &thr[i]);
+    tot->requests += thr[i].requests;
+    tot->bytes_in += thr[i].bytes_in;
+    tot->bytes_out += thr[i].bytes_out;
+    tot->conns_opened += thr[i].conns_opened;
+    tot->conns_closed += thr[i].conns_closed;
+    tot->queue_depth += thr[i].queue_depth;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int bind_port = 7891;
+  char *name = NULL;
+  double interval = 1.0;
+  long count = -1;
+  int per_thread = 0;
+
+  argc--;  argv++;
+  while (argc > 0) {
+    if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
+      printf("Usage: dw_top [-h|--help] [-bp bindport] [-n shm_name] [-i interval(s)] [-c count] [-t|--per-thread]\n"
+             "\n"
+             "Samples the live counters published by dw_node --shm-counters (bound to\n"
+             "the given port, or with the given shm name), printing per-second rates\n"
+             "every interval.\n");
+      exit(EXIT_SUCCESS);
+    } else if (strcmp(argv[0], "-bp") == 0) {
+      assert(argc >= 2);
+      bind_port = atoi(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-n") == 0) {
+      assert(argc >= 2);
+      name = argv[1];
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-i") == 0) {
+      assert(argc >= 2);
+      interval = atof(argv[1]);
+      check(interval > 0);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-c") == 0) {
+      assert(argc >= 2);
+      count = atol(argv[1]);
+      argc--;  argv++;
+    } else if (strcmp(argv[0], "-t") == 0 || strcmp(argv[0], "--per-thread") == 0) {
+      per_thread = 1;
+    } else {
+      printf("Unrecognized option: %s\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    argc--;  argv++;
+  }
+
+  char shm_name[64];
+  if (name == NULL) {
+    counters_shm_name(shm_name, sizeof(shm_name), bind_port);
+    name = shm_name;
+  }
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("shm_open");
+    fprintf(stderr, "Is dw_node running with --shm-counters?\n");
+    exit(EXIT_FAILURE);
+  }
+  node_counters_t *nc = mmap(NULL, sizeof(node_counters_t), PROT_READ, MAP_SHARED, fd, 0);
+  check(nc != MAP_FAILED);
+  close(fd);
+  check(__atomic_load_n(&nc->magic, __ATOMIC_ACQUIRE) == COUNTERS_MAGIC);
+  check(nc->num_threads <= COUNTERS_MAX_THREADS);
+
+  printf("Monitoring dw_node pid %d (%s), %u threads\n", nc->pid, name, nc->num_threads);
+
+  static thread_counters_t prev_thr[COUNTERS_MAX_THREADS], curr_thr[COUNTERS_MAX_THREADS];
+  thread_counters_t prev, curr;
+  struct timespec ts_prev, ts_curr;
+  struct timespec ts_delta = { (long) interval, (long) ((interval - (long) interval) * 1e9) };
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_prev);
+  sample(nc, &prev, prev_thr);
+  struct timespec ts_next = ts_prev;
+  for (long i = 0; count < 0 || i < count; i++) {
+    ts_next = ts_add(ts_next, ts_delta);
+    sys_check(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts_next, NULL));
+    clock_gettime(CLOCK_MONOTONIC, &ts_curr);
+    sample(nc, &curr, curr_thr);
+    double secs = ts_sub_us(ts_curr, ts_prev) / 1e6;
+
+    if (i % 20 == 0)
+      printf("%10s %10s %10s %10s %8s %8s\n", "req/s", "MB/s in", "MB/s out", "conns/s", "conns", "queue");
+    printf("%10.0f %10.3f %10.3f %10.1f %8lu %8lu\n",
+           (curr.requests - prev.requests) / secs,
+           (curr.bytes_in - prev.bytes_in) / secs / 1e6,
+           (curr.bytes_out - prev.bytes_out) / secs / 1e6,
+           (curr.conns_opened - prev.conns_opened) / secs,
+           curr.conns_opened - curr.conns_closed,
+           curr.queue_depth);
+    if (per_thread) {
+      for (int t = 0; t < nc->num_threads; t++) {
+        if (curr_thr[t].requests == prev_thr[t].requests && curr_thr[t].queue_depth == 0)
+          continue;
+        printf("  thr %2d: %10.0f req/s, queue %lu\n", t,
+               (curr_thr[t].requests - prev_thr[t].requests) / secs, curr_thr[t].queue_depth);
+      }
+    }
+    fflush(stdout);
+
+    prev = curr;
+    memcpy(prev_thr, curr_thr, sizeof(prev_thr));
+    ts_prev = ts_curr;
+  }
+
+  munmap(nc, sizeof(node_counters_t));
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include "trace.h"
+#include "cw_debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Converts a binary trace written by dw_node/dw_client --trace into
+// the Chrome trace event JSON format (chrome://tracing, Perfetto):
+// BEGIN/END pairs become duration events, the others instant events.
+
+const char *ev_names[TR_NUM] = {
+  [TR_RECV] = "recv",
+  [TR_PARSE] = "parse",
+  [TR_COMPUTE_BEGIN] = "compute",
+  [TR_COMPUTE_END] = "compute",
+  [TR_STORE_BEGIN] = "store",
+  [TR_STORE_END] = "store",
+  [TR_LOAD_BEGIN] = "load",
+  [TR_LOAD_END] = "load",
+  [TR_SEND_BEGIN] = "send",
+  [TR_SEND_END] = "send",
+};
+
+const char *ev_phase(uint16_t type) {
+  switch (type) {
+    case TR_COMPUTE_BEGIN: case TR_STORE_BEGIN: case TR_LOAD_BEGIN: case TR_SEND_BEGIN:
+      return "B";
+    case TR_COMPUTE_END: case TR_STORE_END: case TR_LOAD_END: case TR_SEND_END:
+      return "E";
+    default:
+      return "i";
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+    printf("Usage: dw_trace2json trace.bin [out.json]\n");
+    exit(argc < 2 ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  FILE *out = stdout;
+  if (argc >= 3) {
+    out = fopen(argv[2], "w");
+    check(out != NULL);
+  }
+
+  trace_file_hdr_t hdr;
+  check(fread(&hdr, sizeof(hdr), 1, in) == 1);
+  check(hdr.magic == TRACE_MAGIC);
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"start_realtime_ns\":%lu},\"traceEvents\":[\n", hdr.ns0);
+  int first = 1;
+  for (int r = 0; r < hdr.num_rings; r++) {
+    trace_ring_hdr_t rh;
+    check(fread(&rh, sizeof(rh), 1, in) == 1);
+    for (uint32_t i = 0; i < rh.num_events; i++) {
+      trace_ev_t ev;
+      check(fread(&ev, sizeof(ev), 1, in) == 1);
+      if (ev.type >= TR_NUM)
+        continue;
+      // timestamps in us since trace_init()
+      double ts = ((double) (int64_t) (ev.tsc - hdr.tsc0)) / hdr.tsc_per_ns / 1000.0;
+      fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%u,%s\"args\":{\"req_id\":%u,\"arg\":%u}}",
+              first ? "" : ",\n", ev_names[ev.type], ev_phase(ev.type), ts, rh.id,
+              ev_phase(ev.type)[0] == 'i' ? "\"s\":\"t\"," : "", ev.req_id, ev.arg);
+      first = 0;
+    }
+  }
+  fprintf(out, "\n]}\n");
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
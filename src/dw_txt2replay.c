@@ -0,0 +1,74 @@
+#include "replay.h"
+#include "message.h"
+#include "cw_debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Converts a text request trace into the binary format replayed by
+// dw_client --replay: one "ts_us cmd req_size resp_size arg" line per
+// request (blank and '#' lines are skipped), where ts_us is the send
+// time in microseconds since the start of the trace, cmd one of
+// COMPUTE, STORE or LOAD, and arg the comp_time_us, or the bytes to
+// store or load.
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+    printf("Usage: dw_txt2replay trace.txt trace.bin\n");
+    exit(argc < 3 ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL) {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  FILE *out = fopen(argv[2], "w");
+  check(out != NULL);
+
+  replay_hdr_t hdr = { .magic = REPLAY_MAGIC, .rec_size = sizeof(replay_rec_t), .num_recs = 0 };
+  check(fwrite(&hdr, sizeof(hdr), 1, out) == 1);
+
+  char line[256];
+  int lineno = 0;
+  uint64_t last_ns = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    lineno++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+    double ts_us;
+    char cmd[16];
+    replay_rec_t rec;
+    if (sscanf(p, "%lf %15s %u %u %u", &ts_us, cmd, &rec.req_size, &rec.resp_size, &rec.arg) != 5) {
+      fprintf(stderr, "%s:%d: expected ts_us cmd req_size resp_size arg\n", argv[1], lineno);
+      exit(EXIT_FAILURE);
+    }
+    if (strcasecmp(cmd, "COMPUTE") == 0) {
+      rec.cmd = COMPUTE;
+    } else if (strcasecmp(cmd, "STORE") == 0) {
+      rec.cmd = STORE;
+    } else if (strcasecmp(cmd, "LOAD") == 0) {
+      rec.cmd = LOAD;
+    } else {
+      fprintf(stderr, "%s:%d: unknown command %s\n", argv[1], lineno, cmd);
+      exit(EXIT_FAILURE);
+    }
+    rec.ts_ns = (uint64_t) (ts_us * 1000.0 + 0.5);
+    if (ts_us < 0 || rec.ts_ns < last_ns) {
+      fprintf(stderr, "%s:%d: timestamps must be non-negative and non-decreasing\n", argv[1], lineno);
+      exit(EXIT_FAILURE);
+    }
+    last_ns = rec.ts_ns;
+    check(fwrite(&rec, sizeof(rec), 1, out) == 1);
+    hdr.num_recs++;
+  }
+  fclose(in);
+
+  check(fseek(out, 0, SEEK_SET) == 0);
+  check(fwrite(&hdr, sizeof(hdr), 1, out) == 1);
+  check(fclose(out) == 0);
+  printf("Converted %lu requests, spanning %g s\n", hdr.num_recs, last_ns / 1e9);
+  return 0;
+}
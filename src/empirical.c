@@ -0,0 +1,129 @@
+#include "empirical.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Vose's alias method: columns with less than average weight get
+// topped up with the excess of a column above average
+static void emp_build_alias(emp_dist_t *d, double *w, double sum) {
+  int *small = malloc(d->n * sizeof(int));
+  int *large = malloc(d->n * sizeof(int));
+  int ns = 0, nl = 0;
+  for (int i = 0; i < d->n; i++) {
+    w[i] = w[i] * d->n / sum;
+    if (w[i] < 1.0)
+      small[ns++] = i;
+    else
+      large[nl++] = i;
+  }
+  while (ns > 0 && nl > 0) {
+    int s = small[--ns], l = large[--nl];
+    d->prob[s] = w[s];
+    d->alias[s] = l;
+    w[l] -= 1.0 - w[s];
+    if (w[l] < 1.0)
+      small[ns++] = l;
+    else
+      large[nl++] = l;
+  }
+  // left overs are 1 up to rounding errors
+  while (nl > 0) {
+    int l = large[--nl];
+    d->prob[l] = 1.0;
+    d->alias[l] = l;
+  }
+  while (ns > 0) {
+    int s = small[--ns];
+    d->prob[s] = 1.0;
+    d->alias[s] = s;
+  }
+  free(small);
+  free(large);
+}
+
+int emp_load(emp_dist_t *d, const char *fname) {
+  FILE *f = fopen(fname, "r");
+  if (f == NULL) {
+    perror(fname);
+    return -1;
+  }
+  int cap = 0, cdf = 0, lineno = 0;
+  double *w = NULL, sum = 0, prev_cum = 0, vsum = 0;
+  char line[256];
+  d->n = 0;
+  d->value = NULL;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#') {
+      p++;
+      if (strncmp(p + strspn(p, " \t"), "cdf", 3) == 0)
+        cdf = 1;
+      continue;
+    }
+    double v, x = 1.0;
+    int k = sscanf(p, "%lf%*[ \t,]%lf", &v, &x);
+    if (k == EOF)
+      continue;
+    if (k == 0 || (cdf && k < 2) || v < 0) {
+      fprintf(stderr, "%s:%d: expected non-negative value and %s\n", fname, lineno, cdf ? "cumulative probability" : "optional weight");
+      goto err;
+    }
+    if (cdf) {
+      double cum = x;
+      x = cum - prev_cum;
+      prev_cum = cum;
+    }
+    if (x < 0) {
+      fprintf(stderr, "%s:%d: negative weight, or decreasing cumulative probability\n", fname, lineno);
+      goto err;
+    }
+    if (d->n == cap) {
+      cap = cap ? 2 * cap : 64;
+      d->value = realloc(d->value, cap * sizeof(double));
+      w = realloc(w, cap * sizeof(double));
+      if (d->value == NULL || w == NULL) {
+        perror("realloc");
+        goto err;
+      }
+    }
+    d->value[d->n] = v;
+    w[d->n++] = x;
+    sum += x;
+    vsum += v * x;
+  }
+  fclose(f);
+  if (sum <= 0) {
+    fprintf(stderr, "%s: no entries with positive weight\n", fname);
+    free(d->value);
+    free(w);
+    d->n = 0;
+    return -1;
+  }
+  d->mean = vsum / sum;
+  d->prob = malloc(d->n * sizeof(double));
+  d->alias = malloc(d->n * sizeof(int));
+  if (d->prob == NULL || d->alias == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  emp_build_alias(d, w, sum);
+  free(w);
+  return 0;
+
+ err:
+  fclose(f);
+  free(d->value);
+  free(w);
+  d->n = 0;
+  return -1;
+}
+
+double emp_sample(const emp_dist_t *d, rng_t *rng) {
+  double x = rng_uniform(rng) * d->n;
+  int i = (int) x;
+  if (i >= d->n)
+    i = d->n - 1;
+  return x - i < d->prob[i] ? d->value[i] : d->value[d->alias[i]];
+}
@@ -0,0 +1,25 @@
+#ifndef __EMPIRICAL_H__
+#define __EMPIRICAL_H__
+
+#include "rng.h"
+
+// Empirical distribution, loaded from a text file with one "value
+// [weight]" pair per line (weight defaults to 1, so a list of raw
+// samples works as well), or "value cumulative_probability" pairs if
+// the file has a "# cdf" line before them. Samples are drawn in O(1)
+// with the alias method, with a single uniform random number.
+typedef struct {
+  int n;		// 0 if not loaded
+  double *value;
+  double *prob;		// probability of returning value[i] rather than value[alias[i]]
+  int *alias;
+  double mean;
+} emp_dist_t;
+
+// Load fname into d, returning 0 on success, or -1 (with an error
+// message) if it could not be read or has no valid entries
+int emp_load(emp_dist_t *d, const char *fname);
+
+double emp_sample(const emp_dist_t *d, rng_t *rng);
+
+#endif
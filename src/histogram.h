@@ -0,0 +1,118 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+// Log-linear (HDR-style) histogram of non-negative integer values
+// (typically nanoseconds): values below HIST_SUB are counted exactly,
+// larger values fall into one of HIST_SUB linear sub-buckets of their
+// power-of-two range, i.e., with a relative error below 1/HIST_SUB.
+//
+// A histogram is meant to be updated by a single writer thread, while
+// other threads may concurrently hist_merge() it: counters are written
+// with relaxed atomic stores (plain movs on x86), so no locked
+// instructions are needed on the hot path.
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 48	// larger values are clamped into the last bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t cnt[HIST_BUCKETS];
+} hist_t;
+
+static inline int hist_index(uint64_t v) {
+  if (v < HIST_SUB)
+    return v;
+  int e = 63 - __builtin_clzll(v);
+  if (e >= HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// lowest value falling into bucket i
+static inline uint64_t hist_bucket_low(int i) {
+  if (i < HIST_SUB)
+    return i;
+  int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return ((uint64_t) (HIST_SUB + i % HIST_SUB)) << (e - HIST_SUB_BITS);
+}
+
+// highest value falling into bucket i
+static inline uint64_t hist_bucket_high(int i) {
+  if (i < HIST_SUB)
+    return i;
+  int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return hist_bucket_low(i) + (1ul << (e - HIST_SUB_BITS)) - 1;
+}
+
+static inline void hist_reset(hist_t *h) {
+  memset(h, 0, sizeof(*h));
+}
+
+// single-writer update
+static inline void hist_add(hist_t *h, uint64_t v) {
+  int i = hist_index(v);
+  __atomic_store_n(&h->cnt[i], h->cnt[i] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+// dst += src, where src may be concurrently updated by its writer
+static inline void hist_merge(hist_t *dst, hist_t *src) {
+  dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->cnt[i] += __atomic_load_n(&src->cnt[i], __ATOMIC_RELAXED);
+}
+
+// dst -= src, used to discount a previously taken snapshot
+static inline void hist_sub(hist_t *dst, const hist_t *src) {
+  dst->count -= src->count;
+  dst->sum -= src->sum;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->cnt[i] -= src->cnt[i];
+}
+
+// Value at percentile p (0.0-100.0), reported as the highest value of
+// the bucket it falls into (0 for an empty histogram)
+static inline uint64_t hist_percentile(const hist_t *h, double p) {
+  if (h->count == 0)
+    return 0;
+  uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->cnt[i];
+    if (seen >= rank)
+      return hist_bucket_high(i);
+  }
+  return hist_bucket_high(HIST_BUCKETS - 1);
+}
+
+static inline uint64_t hist_min(const hist_t *h) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    if (h->cnt[i] > 0)
+      return hist_bucket_low(i);
+  return 0;
+}
+
+static inline uint64_t hist_max(const hist_t *h) {
+  for (int i = HIST_BUCKETS - 1; i >= 0; i--)
+    if (h->cnt[i] > 0)
+      return hist_bucket_high(i);
+  return 0;
+}
+
+static inline uint64_t hist_mean(const hist_t *h) {
+  return h->count > 0 ? h->sum / h->count : 0;
+}
+
+#endif
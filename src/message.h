@@ -4,19 +4,25 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <netinet/in.h>
 
 #define BUF_SIZE (16*1024*1024)
+#define UDP_MAX_SIZE 65507	// max message size with --udp (UDP payload over IPv4)
+// max message size over connections: messages larger than BUF_SIZE are
+// streamed through BUF_SIZE buffers, without MSG_TIMESTAMPS
+#define STREAM_MAX_SIZE 0xffffffffUL
 
-typedef enum { COMPUTE, STORE, LOAD, FORWARD, REPLY } command_type_t;
+typedef enum { COMPUTE, STORE, LOAD, FORWARD, REPLY, STATS } command_type_t;
 
-const char* get_command_name(command_type_t cmd) {
+static inline const char* get_command_name(command_type_t cmd) {
   switch (cmd) {
     case COMPUTE: return "COMPUTE";
     case STORE: return "STORE";
     case LOAD: return "LOAD";
     case FORWARD: return "FORWARD";
     case REPLY: return "REPLY";
+    case STATS: return "STATS";
     default: 
       printf("Unknown command type\n");
       exit(-1);
@@ -46,6 +52,7 @@ typedef struct {
     uint32_t store_nbytes;	// STORE data size
     uint32_t load_nbytes;	// LOAD data size
     fwd_opts_t fwd;		// FORWARD host+port and pkt size
+    uint32_t stats_flags;	// STATS options (STATS_*)
     //reply_opts_t reply;	// REPLY pkt size
   } u;
 } command_t;
@@ -54,7 +61,109 @@ typedef struct {
   uint32_t req_id;
   uint32_t req_size;	// Overall message size in bytes, including commands and payload
   uint8_t num;		// Number of valid entries in cmds[]
+  uint8_t flags;	// MSG_* flags
   command_t cmds[];	// Up to 255 command_t
 } message_t;
 
+// Ask each traversed node to append its hop_stamps_t to the message
+// trailer, i.e., the last bytes of the message, made of the stamps of
+// the hops so far followed by their uint32_t count (0 when sent by the
+// client); nodes enlarge req_size of forwarded/replied messages as needed
+#define MSG_TIMESTAMPS 1
+
+// absolute CLOCK_REALTIME stamps of a node hop, in ns
+typedef struct {
+  uint64_t recv_ns;	// request data received
+  uint64_t start_ns;	// start of service
+  uint64_t end_ns;	// end of service (before FORWARD/REPLY)
+  uint64_t send_ns;	// start of send to next hop
+} hop_stamps_t;
+
+#define TRAILER_SIZE(num_hops) ((num_hops) * sizeof(hop_stamps_t) + sizeof(uint32_t))
+
+static inline uint32_t trailer_num_hops(message_t *m) {
+  uint32_t n;
+  memcpy(&n, (unsigned char *) m + m->req_size - sizeof(n), sizeof(n));
+  return n;
+}
+
+static inline void trailer_get_hop(message_t *m, uint32_t n, int i, hop_stamps_t *hs) {
+  memcpy(hs, (unsigned char *) m + m->req_size - TRAILER_SIZE(n) + i * sizeof(*hs), sizeof(*hs));
+}
+
+// STATS makes the node append a node_stats_t right after the cmds[]
+// of the following REPLY, whose pkt_size is enlarged if needed
+#define STATS_RESET 1		// reset node statistics after reporting them
+
+// PROXY is the time a proxy node (dw_node --proxy) waits for backend replies
+typedef enum { STAT_QUEUE, STAT_COMPUTE, STAT_STORE, STAT_LOAD, STAT_SEND, STAT_PROXY, STAT_NUM } stat_id_t;
+
+static inline const char* get_stat_name(stat_id_t id) {
+  switch (id) {
+    case STAT_QUEUE: return "QUEUE";
+    case STAT_COMPUTE: return "COMPUTE";
+    case STAT_STORE: return "STORE";
+    case STAT_LOAD: return "LOAD";
+    case STAT_SEND: return "SEND";
+    case STAT_PROXY: return "PROXY";
+    default:
+      printf("Unknown stat id\n");
+      exit(-1);
+  }
+}
+
+typedef struct {
+  uint64_t count;
+  uint64_t mean_ns;
+  uint64_t min_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+} stat_summary_t;
+
+// Per-request perf event counters (dw_node --perf-events), measured
+// around the execution of the commands of each request; where
+// hardware events are not available, software ones are used instead,
+// as flagged in perf_stats_t.sw_mask (see get_perf_counter_name())
+typedef enum { PC_CYCLES, PC_INSTRUCTIONS, PC_CTX_SWITCHES, PC_CPU_MIGRATIONS, PC_CACHE_MISSES, PC_NUM } perf_counter_t;
+
+static inline const char* get_perf_counter_name(perf_counter_t pc, int sw) {
+  switch (pc) {
+    case PC_CYCLES: return sw ? "task-clock(ns)" : "cycles";
+    case PC_INSTRUCTIONS: return "instructions";
+    case PC_CTX_SWITCHES: return "context-switches";
+    case PC_CPU_MIGRATIONS: return "cpu-migrations";
+    case PC_CACHE_MISSES: return sw ? "page-faults" : "cache-misses";
+    default:
+      printf("Unknown perf counter\n");
+      exit(-1);
+  }
+}
+
+typedef struct {
+  uint32_t avail_mask;		// bit i set if counter i was measured
+  uint32_t sw_mask;		// bit i set if counter i fell back to a software event
+  uint64_t samples;		// requests measured
+  uint64_t preempted;		// requests with context switches
+  uint64_t migrated;		// requests with CPU migrations
+  uint64_t sum[PC_NUM];		// sum of per-request deltas
+} perf_stats_t;
+
+// Time node threads spent in epoll_wait(), either spinning on it
+// without finding events (dw_node --busy-poll), or blocked in it
+typedef struct {
+  uint64_t spin_ns;
+  uint64_t sleep_ns;
+  uint64_t sleeps;		// blocking epoll_wait() calls
+} poll_stats_t;
+
+typedef struct {
+  uint64_t elapsed_ns;		// time covered, since node start or last reset
+  stat_summary_t stats[STAT_NUM];
+  perf_stats_t perf;
+  poll_stats_t poll;
+} node_stats_t;
+
 #endif
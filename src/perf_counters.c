@@ -0,0 +1,85 @@
+#include "perf_counters.h"
+#include "cw_debug.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} pc_hw[PC_NUM] = {
+  [PC_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  [PC_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  [PC_CTX_SWITCHES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  [PC_CPU_MIGRATIONS] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+  [PC_CACHE_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+}, pc_sw[PC_NUM] = {
+  // software replacements, if any (type PERF_TYPE_MAX if none)
+  [PC_CYCLES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  [PC_INSTRUCTIONS] = { PERF_TYPE_MAX, 0 },
+  [PC_CTX_SWITCHES] = { PERF_TYPE_MAX, 0 },
+  [PC_CPU_MIGRATIONS] = { PERF_TYPE_MAX, 0 },
+  [PC_CACHE_MISSES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static int pc_open(uint32_t type, uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_hv = 1;
+  // measure the calling thread, on any CPU
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    // retry counting only user-space, as allowed by perf_event_paranoid=2
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  }
+  if (fd < 0)
+    cw_log("perf_event_open(%u, %lu): %s\n", type, config, strerror(errno));
+  return fd;
+}
+
+int perf_group_open(perf_group_t *g) {
+  g->leader = -1;
+  g->num = 0;
+  g->avail_mask = g->sw_mask = 0;
+  for (int i = 0; i < PC_NUM; i++) {
+    g->fds[i] = pc_open(pc_hw[i].type, pc_hw[i].config, g->leader);
+    if (g->fds[i] < 0 && pc_sw[i].type != PERF_TYPE_MAX) {
+      g->fds[i] = pc_open(pc_sw[i].type, pc_sw[i].config, g->leader);
+      if (g->fds[i] >= 0)
+        g->sw_mask |= 1 << i;
+    }
+    if (g->fds[i] < 0) {
+      g->pos[i] = -1;
+      continue;
+    }
+    if (g->leader < 0)
+      g->leader = g->fds[i];
+    g->pos[i] = g->num++;
+    g->avail_mask |= 1 << i;
+  }
+  return g->num;
+}
+
+int perf_group_read(perf_group_t *g, uint64_t vals[PC_NUM]) {
+  uint64_t buf[1 + PC_NUM];	// nr, then values
+  if (g->leader < 0 || read(g->leader, buf, sizeof(buf)) < (ssize_t) ((1 + g->num) * sizeof(uint64_t)))
+    return -1;
+  for (int i = 0; i < PC_NUM; i++)
+    vals[i] = g->pos[i] >= 0 ? buf[1 + g->pos[i]] : 0;
+  return 0;
+}
+
+void perf_group_close(perf_group_t *g) {
+  for (int i = 0; i < PC_NUM; i++)
+    if (g->fds[i] >= 0)
+      close(g->fds[i]);
+  g->leader = -1;
+}
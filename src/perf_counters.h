@@ -0,0 +1,28 @@
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include "message.h"
+
+#include <stdint.h>
+
+// Group of per-thread perf events, read with a single read() syscall
+typedef struct {
+  int leader;			// group leader fd, -1 if nothing could be opened
+  int fds[PC_NUM];		// -1 for unavailable counters
+  int pos[PC_NUM];		// position of each counter in the group read
+  int num;			// number of events in the group
+  uint32_t avail_mask;
+  uint32_t sw_mask;
+} perf_group_t;
+
+// Open the counters for the calling thread, falling back to software
+// events if hardware ones are not available; returns the number of
+// events that could be opened
+int perf_group_open(perf_group_t *g);
+
+// Read current counter values into vals[] (0 for unavailable ones)
+int perf_group_read(perf_group_t *g, uint64_t vals[PC_NUM]);
+
+void perf_group_close(perf_group_t *g);
+
+#endif
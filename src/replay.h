@@ -0,0 +1,27 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+// Request traces replayed by dw_client --replay: a replay_hdr_t
+// followed by num_recs replay_rec_t, in send time order, as written by
+// dw_txt2replay. The client maps the file and walks it sequentially,
+// so traces are only bounded by disk space.
+
+#define REPLAY_MAGIC 0x70727764	// "dwrp"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t rec_size;	// sizeof(replay_rec_t)
+  uint64_t num_recs;
+} replay_hdr_t;
+
+typedef struct {
+  uint64_t ts_ns;	// send time, since the start of the trace
+  uint32_t cmd;		// COMPUTE, STORE or LOAD
+  uint32_t req_size;	// request size, STORE data excluded
+  uint32_t resp_size;	// reply size, LOAD data excluded
+  uint32_t arg;		// comp_time_us, store_nbytes or load_nbytes
+} replay_rec_t;
+
+#endif
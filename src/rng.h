@@ -0,0 +1,134 @@
+#ifndef __RNG_H__
+#define __RNG_H__
+
+#include <stdint.h>
+
+// Per-connection (or per-thread) random variates for dw_client, meant
+// to be cheap at millions of requests per second: RNG_LANES
+// independent xoshiro256** generators fill a block of RNG_BLOCK raw
+// 64-bit values, and of as many unit exponential variates, at a time.
+// Both refill loops run across lanes, or are branch-free (rng_log() is
+// a bit-twiddling log approximation), so that compilers vectorize them,
+// and the per-request cost is taking the next entry of a block. No
+// state is shared, so there is no locking and no contention across
+// threads, unlike rand().
+
+#define RNG_LANES 4
+#define RNG_BLOCK 256		// multiple of RNG_LANES
+
+typedef struct {
+  uint64_t s[4][RNG_LANES];	// xoshiro256** state of each lane
+  uint64_t raw[RNG_BLOCK];
+  double exp[RNG_BLOCK];	// exponential, with mean 1
+  int raw_next;
+  int exp_next;
+} rng_t;
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+// splitmix64, to expand a seed into the xoshiro states
+static inline uint64_t rng_splitmix(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline void rng_fill_raw(rng_t *r, uint64_t *dst) {
+  for (int i = 0; i < RNG_BLOCK; i += RNG_LANES) {
+    for (int l = 0; l < RNG_LANES; l++) {
+      uint64_t *s0 = &r->s[0][l], *s1 = &r->s[1][l], *s2 = &r->s[2][l], *s3 = &r->s[3][l];
+      dst[i + l] = rng_rotl(*s1 * 5, 7) * 9;
+      uint64_t t = *s1 << 17;
+      *s2 ^= *s0;
+      *s3 ^= *s1;
+      *s1 ^= *s2;
+      *s0 ^= *s3;
+      *s2 ^= t;
+      *s3 = rng_rotl(*s3, 45);
+    }
+  }
+}
+
+// uniform in [0, 1) out of the 53 high bits of x
+static inline double rng_to_double(uint64_t x) {
+  return (int64_t) (x >> 11) * 0x1.0p-53;
+}
+
+// uniform in (0, 1] out of the 52 high bits of x, through a double in
+// [1, 2) built from its bits, which avoids int to double conversions
+static inline double rng_to_double_nz(uint64_t x) {
+  union { uint64_t u; double d; } v = { .u = (x >> 12) | 0x3ff0000000000000ull };
+  return 2.0 - v.d;
+}
+
+// Natural log of x > 0 (normal doubles): x = m * 2^e with m in
+// [sqrt(1/2), sqrt(2)), log(m) = 2 atanh((m-1)/(m+1)), the atanh series
+// being cut where its relative error drops below 1e-11. Only 64-bit
+// integer and double ops without branches are used, all available in
+// SSE2 vectors: e and m are found by subtracting the bits of sqrt(1/2)
+// (as in musl), and e is turned into a double through its bits as
+// well, as 2^52 + 2048 + e in offset binary.
+static inline double rng_log(double x) {
+  union { double d; uint64_t u; } v = { .d = x }, ev;
+  uint64_t tmp = v.u - 0x3fe6a09e667f3bcdull;
+  ev.u = 0x4330000000000000ull | ((tmp >> 52) ^ 0x800);
+  double e = ev.d - 0x1.0p52 - 2048;
+  v.u -= tmp & 0xfff0000000000000ull;
+  double m = v.d;
+  double t = (m - 1.0) / (m + 1.0);
+  double t2 = t * t;
+  double p = 1.0 / 13;
+  p = p * t2 + 1.0 / 11;
+  p = p * t2 + 1.0 / 9;
+  p = p * t2 + 1.0 / 7;
+  p = p * t2 + 1.0 / 5;
+  p = p * t2 + 1.0 / 3;
+  p = p * t2 + 1.0;
+  return 2.0 * t * p + e * 0.6931471805599453;
+}
+
+static inline void rng_fill_exp(rng_t *r) {
+  uint64_t raw[RNG_BLOCK];
+  rng_fill_raw(r, raw);
+  for (int i = 0; i < RNG_BLOCK; i++)
+    r->exp[i] = -rng_log(rng_to_double_nz(raw[i]));
+  r->exp_next = 0;
+}
+
+static inline void rng_seed(rng_t *r, uint64_t seed) {
+  for (int l = 0; l < RNG_LANES; l++)
+    for (int j = 0; j < 4; j++)
+      r->s[j][l] = rng_splitmix(&seed);
+  r->raw_next = RNG_BLOCK;
+  r->exp_next = RNG_BLOCK;
+}
+
+static inline uint64_t rng_u64(rng_t *r) {
+  if (r->raw_next == RNG_BLOCK) {
+    rng_fill_raw(r, r->raw);
+    r->raw_next = 0;
+  }
+  return r->raw[r->raw_next++];
+}
+
+// uniform in [0, 1)
+static inline double rng_uniform(rng_t *r) {
+  return rng_to_double(rng_u64(r));
+}
+
+// uniform in [0, n), n > 0 (multiply-shift, bias below n / 2^64)
+static inline uint64_t rng_below(rng_t *r, uint64_t n) {
+  return (uint64_t) (((unsigned __int128) rng_u64(r) * n) >> 64);
+}
+
+// exponential with rate lambda (mean 1 / lambda), as expon()
+static inline double rng_expon(rng_t *r, double lambda) {
+  if (r->exp_next == RNG_BLOCK)
+    rng_fill_exp(r);
+  return r->exp[r->exp_next++] / lambda;
+}
+
+#endif
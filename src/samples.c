@@ -0,0 +1,55 @@
+#define _GNU_SOURCE
+#include "samples.h"
+#include "cw_debug.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SAMPLES_INIT_CAPACITY 65536
+
+static size_t samples_map_size(uint64_t capacity) {
+  return sizeof(samples_file_hdr_t) + capacity * sizeof(sample_t);
+}
+
+void samples_open(samples_t *s, const char *path, int worker_id, uint64_t start_ns) {
+  if (path) {
+    sys_check(s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644));
+  } else {
+    char tmp_path[] = "/tmp/dw_client-samples-XXXXXX";
+    sys_check(s->fd = mkstemp(tmp_path));
+    unlink(tmp_path);
+  }
+  s->capacity = SAMPLES_INIT_CAPACITY;
+  sys_check(ftruncate(s->fd, samples_map_size(s->capacity)));
+  s->hdr = mmap(NULL, samples_map_size(s->capacity), PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  check(s->hdr != MAP_FAILED);
+  s->hdr->magic = SAMPLES_MAGIC;
+  s->hdr->sample_size = sizeof(sample_t);
+  s->hdr->worker_id = worker_id;
+  s->hdr->num_samples = 0;
+  s->hdr->start_ns = start_ns;
+}
+
+uint64_t samples_append(samples_t *s) {
+  if (s->hdr->num_samples == s->capacity) {
+    size_t old_size = samples_map_size(s->capacity);
+    s->capacity *= 2;
+    sys_check(ftruncate(s->fd, samples_map_size(s->capacity)));
+    s->hdr = mremap(s->hdr, old_size, samples_map_size(s->capacity), MREMAP_MAYMOVE);
+    check(s->hdr != MAP_FAILED);
+  }
+  // newly extended file areas read as zero
+  return s->hdr->num_samples++;
+}
+
+void samples_close(samples_t *s) {
+  size_t size = samples_map_size(s->hdr->num_samples);
+  munmap(s->hdr, samples_map_size(s->capacity));
+  sys_check(ftruncate(s->fd, size));
+  close(s->fd);
+  s->hdr = NULL;
+}
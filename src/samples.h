@@ -0,0 +1,65 @@
+#ifndef __SAMPLES_H__
+#define __SAMPLES_H__
+
+#include <stdint.h>
+
+// Per-request samples collected by dw_client: each worker thread
+// appends fixed-size binary records to its own memory-mapped file,
+// which is grown as needed, so the number of samples is only bounded
+// by disk space, and the memory they take is managed by the page cache.
+
+typedef enum { BD_NET_OUT, BD_QUEUE, BD_SERVICE, BD_NET_BACK, BD_NUM } breakdown_t;
+
+#define SAMPLE_REPLIED 1	// elapsed_us is valid
+#define SAMPLE_BREAKDOWN 2	// bd[] is valid
+
+typedef struct {
+  int64_t send_us;	// send time since start of experiment
+  int64_t intended_us;	// scheduled send time, send_us minus it being how late it was sent
+  int64_t elapsed_us;	// end-to-end time, 0 if no reply was received
+  uint32_t req_id;
+  uint32_t conn_id;
+  uint32_t sess_id;
+  uint32_t flags;	// SAMPLE_*
+  int32_t bd[BD_NUM];	// with server timestamps, breakdown of elapsed_us
+  uint32_t backend;	// index of the server node the request was sent to
+  uint32_t pad;
+} sample_t;
+
+#define SAMPLES_MAGIC 0x3153454c504d4153ul	// "SAMPLES1"
+
+// file layout: samples_file_hdr_t followed by num_samples sample_t
+typedef struct {
+  uint64_t magic;
+  uint32_t sample_size;	// sizeof(sample_t)
+  uint32_t worker_id;
+  uint64_t num_samples;
+  uint64_t start_ns;	// start of experiment (CLOCK_REALTIME ns)
+} samples_file_hdr_t;
+
+typedef struct {
+  int fd;
+  samples_file_hdr_t *hdr;	// mapping of the whole file
+  uint64_t capacity;		// samples fitting in the current mapping
+} samples_t;
+
+// Create the samples file at path, or an unlinked temporary one if
+// path is NULL
+void samples_open(samples_t *s, const char *path, int worker_id, uint64_t start_ns);
+
+// Append a zeroed sample, returning its index. The mapping may move,
+// so samples are referred to by index rather than by pointer
+uint64_t samples_append(samples_t *s);
+
+static inline sample_t *samples_get(samples_t *s, uint64_t i) {
+  return ((sample_t *) (s->hdr + 1)) + i;
+}
+
+static inline uint64_t samples_num(samples_t *s) {
+  return s->hdr->num_samples;
+}
+
+// Truncate the file to the samples actually appended and unmap it
+void samples_close(samples_t *s);
+
+#endif
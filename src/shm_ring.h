@@ -0,0 +1,170 @@
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Shared-memory transport between a co-located dw_client and dw_node
+// (--shm): the client maps a memfd holding two single-producer
+// single-consumer byte rings, carrying the same message_t stream as a
+// TCP connection (requests to the node, replies to the client), and
+// passes it to the node over a Unix domain socket, along with one
+// eventfd per direction (SHM_FD_*).
+//
+// Wake-ups are only needed when the consumer ran out of data: before
+// sleeping, it sets cons_waiting and re-checks the ring, and the
+// producer signals the eventfd only if it sees cons_waiting set after
+// publishing its data (all of these accesses are sequentially
+// consistent, so one of them always sees the other). The same goes for
+// a producer waiting for room (prod_waiting).
+
+#define SHM_RING_DEF_SIZE (1 << 20)
+
+typedef struct {
+  // written by the producer
+  uint64_t head __attribute__((aligned(64)));	// bytes ever written
+  uint32_t prod_waiting;			// producer waits for room
+  // written by the consumer
+  uint64_t tail __attribute__((aligned(64)));	// bytes ever read
+  uint32_t cons_waiting;			// consumer waits for data
+  uint32_t size __attribute__((aligned(64)));	// power of 2
+  unsigned char data[];
+} shm_ring_t;
+
+typedef enum { SHM_RING_REQ, SHM_RING_REPLY, SHM_RING_NUM } shm_ring_id_t;
+
+// fds passed to the node: memfd, eventfd the node waits on for
+// requests, eventfd the client waits on for replies (or room)
+typedef enum { SHM_FD_MEM, SHM_FD_TO_NODE, SHM_FD_TO_CLIENT, SHM_FD_NUM } shm_fd_id_t;
+
+// pause in a spin-wait loop, e.g., polling a ring (--shm-spin)
+#if defined(__x86_64__) || defined(__i386__)
+static inline void cpu_relax() {
+  __builtin_ia32_pause();
+}
+#elif defined(__aarch64__)
+static inline void cpu_relax() {
+  __asm__ __volatile__("yield" ::: "memory");
+}
+#else
+static inline void cpu_relax() {
+  __asm__ __volatile__("" ::: "memory");
+}
+#endif
+
+static inline unsigned long shm_map_size(uint32_t ring_size) {
+  return SHM_RING_NUM * (sizeof(shm_ring_t) + ring_size);
+}
+
+static inline shm_ring_t *shm_ring_get(void *map, uint32_t ring_size, shm_ring_id_t id) {
+  return (shm_ring_t *) ((unsigned char *) map + id * (sizeof(shm_ring_t) + ring_size));
+}
+
+static inline unsigned long shm_ring_readable(shm_ring_t *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) - r->tail;
+}
+
+static inline unsigned long shm_ring_room(shm_ring_t *r) {
+  return r->size - (r->head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST));
+}
+
+// producer: copy up to len bytes of buf, returning how many fit
+static inline unsigned long shm_ring_write(shm_ring_t *r, const void *buf, unsigned long len) {
+  unsigned long n = shm_ring_room(r);
+  if (n > len)
+    n = len;
+  unsigned long off = r->head & (r->size - 1);
+  unsigned long first = n < r->size - off ? n : r->size - off;
+  memcpy(r->data + off, buf, first);
+  memcpy(r->data, (const unsigned char *) buf + first, n - first);
+  __atomic_store_n(&r->head, r->head + n, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+// consumer: copy up to len available bytes into buf, returning how many
+static inline unsigned long shm_ring_read(shm_ring_t *r, void *buf, unsigned long len) {
+  unsigned long n = shm_ring_readable(r);
+  if (n > len)
+    n = len;
+  unsigned long off = r->tail & (r->size - 1);
+  unsigned long first = n < r->size - off ? n : r->size - off;
+  memcpy(buf, r->data + off, first);
+  memcpy((unsigned char *) buf + first, r->data, n - first);
+  __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+// consumer, about to sleep: returns 0 (and stays awake) if data
+// arrived meanwhile
+static inline int shm_ring_cons_wait(shm_ring_t *r) {
+  __atomic_store_n(&r->cons_waiting, 1, __ATOMIC_SEQ_CST);
+  if (shm_ring_readable(r) == 0)
+    return 1;
+  __atomic_store_n(&r->cons_waiting, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// producer, after writing: whether the consumer needs a wake-up
+static inline int shm_ring_cons_wakeup(shm_ring_t *r) {
+  if (!__atomic_load_n(&r->cons_waiting, __ATOMIC_SEQ_CST))
+    return 0;
+  __atomic_store_n(&r->cons_waiting, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// producer, about to sleep on a full ring: returns 0 if room was made
+// meanwhile
+static inline int shm_ring_prod_wait(shm_ring_t *r) {
+  __atomic_store_n(&r->prod_waiting, 1, __ATOMIC_SEQ_CST);
+  if (shm_ring_room(r) == 0)
+    return 1;
+  __atomic_store_n(&r->prod_waiting, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// consumer, after reading: whether the producer needs a wake-up
+static inline int shm_ring_prod_wakeup(shm_ring_t *r) {
+  if (!__atomic_load_n(&r->prod_waiting, __ATOMIC_SEQ_CST))
+    return 0;
+  __atomic_store_n(&r->prod_waiting, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// pass fds[SHM_FD_NUM] over the Unix domain socket sock
+static inline int shm_send_fds(int sock, int fds[SHM_FD_NUM]) {
+  char byte = 0;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(SHM_FD_NUM * sizeof(int))];
+  } ctl;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(SHM_FD_NUM * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, SHM_FD_NUM * sizeof(int));
+  return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+// receive fds[SHM_FD_NUM] sent with shm_send_fds()
+static inline int shm_recv_fds(int sock, int fds[SHM_FD_NUM]) {
+  char byte;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(SHM_FD_NUM * sizeof(int))];
+  } ctl;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+  if (recvmsg(sock, &msg, 0) != 1)
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(SHM_FD_NUM * sizeof(int)))
+    return -1;
+  memcpy(fds, CMSG_DATA(cmsg), SHM_FD_NUM * sizeof(int));
+  return 0;
+}
+
+#endif
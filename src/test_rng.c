@@ -0,0 +1,115 @@
+#include "rng.h"
+#include "expon.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Compares the per-thread generator used by dw_client (rng.h) with
+// expon() and rand(): throughput of each, and accuracy of the
+// exponential variates (mean, standard deviation, chi-square over
+// NUM_BINS equiprobable bins) and of rng_log()
+
+#define NUM_BINS 100
+
+double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+  double sum, sum2;
+  unsigned long bins[NUM_BINS];
+} acc_t;
+
+void acc_add(acc_t *a, double x, double avg) {
+  a->sum += x;
+  a->sum2 += x * x;
+  // exponential CDF, mapped to equiprobable bins
+  int b = (1.0 - exp(-x / avg)) * NUM_BINS;
+  a->bins[b < NUM_BINS ? b : NUM_BINS - 1]++;
+}
+
+void acc_print(const char *name, acc_t *a, unsigned long n, double avg, double ns) {
+  double mean = a->sum / n;
+  double chi2 = 0, e = (double) n / NUM_BINS;
+  for (int b = 0; b < NUM_BINS; b++)
+    chi2 += (a->bins[b] - e) * (a->bins[b] - e) / e;
+  printf("%-12s %8.2f ns/variate, %8.1f M/s, mean: %.5f (%+.4f%%), stddev: %.5f, chi2(%d dof): %.1f\n",
+         name, ns / n, n / ns * 1e3, mean, (mean - avg) / avg * 100, sqrt(a->sum2 / n - mean * mean), NUM_BINS - 1, chi2);
+}
+
+int main(int argc, char **argv) {
+  double avg = 10.0;
+  long unsigned num_samples = 10000000;
+
+  --argc;  ++argv;
+  while (argc > 0) {
+    if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
+      printf("Usage: test_rng [-h|--help] [-n <num_samples>] [-a <average>]\n");
+      exit(0);
+    } else if (strcmp(argv[0], "-n") == 0) {
+      assert(argc >= 2);
+      num_samples = atol(argv[1]);
+      --argc;  ++argv;
+    } else if (strcmp(argv[0], "-a") == 0) {
+      assert(argc >= 2);
+      avg = atof(argv[1]);
+      --argc;  ++argv;
+    }
+    --argc;  ++argv;
+  }
+  printf("avg=%g, num_samples=%lu\n", avg, num_samples);
+
+  struct drand48_data rnd_buf;
+  srand48_r(time(NULL), &rnd_buf);
+  rng_t rng;
+  rng_seed(&rng, time(NULL));
+  static acc_t a_expon, a_rng;
+  volatile double sink = 0;
+
+  // raw generation first, then accuracy, so that accounting stays out
+  // of the timings
+  double t = now_ns();
+  for (unsigned long i = 0; i < num_samples; i++)
+    sink += expon(1.0 / avg, &rnd_buf);
+  double ns_expon = now_ns() - t;
+  t = now_ns();
+  for (unsigned long i = 0; i < num_samples; i++)
+    sink += rng_expon(&rng, 1.0 / avg);
+  double ns_rng = now_ns() - t;
+
+  for (unsigned long i = 0; i < num_samples; i++) {
+    acc_add(&a_expon, expon(1.0 / avg, &rnd_buf), avg);
+    acc_add(&a_rng, rng_expon(&rng, 1.0 / avg), avg);
+  }
+  acc_print("expon()", &a_expon, num_samples, avg, ns_expon);
+  acc_print("rng_expon()", &a_rng, num_samples, avg, ns_rng);
+
+  volatile unsigned long sum = 0;
+  t = now_ns();
+  for (unsigned long i = 0; i < num_samples; i++)
+    sum += rand() % 3;
+  double ns_rand = now_ns() - t;
+  t = now_ns();
+  for (unsigned long i = 0; i < num_samples; i++)
+    sum += rng_below(&rng, 3);
+  double ns_below = now_ns() - t;
+  printf("%-12s %8.2f ns/variate\n%-12s %8.2f ns/variate\n", "rand()", ns_rand / num_samples, "rng_below()", ns_below / num_samples);
+
+  // relative error of rng_log() over [2^-53, 1], as used, and beyond
+  double max_err = 0;
+  for (unsigned long i = 0; i < num_samples; i++) {
+    double x = ldexp(rng_uniform(&rng) + 0.5, (int) rng_below(&rng, 120) - 60);
+    double l = log(x);
+    double err = l != 0 ? fabs((rng_log(x) - l) / l) : fabs(rng_log(x));
+    if (err > max_err)
+      max_err = err;
+  }
+  printf("rng_log() max relative error: %.3g\n", max_err);
+  return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef __TIMESPEC_H__
 #define __TIMESPEC_H__
 
+#include <stdint.h>
 #include <time.h>
 
 static inline struct timespec ts_add(struct timespec a, struct timespec b) {
@@ -30,6 +31,15 @@ static inline long ts_sub_us(struct timespec a, struct timespec b) {
   return (c.tv_sec * 1000000) + c.tv_nsec / 1000;
 }
 
+static inline long ts_sub_ns(struct timespec a, struct timespec b) {
+  struct timespec c = ts_sub(a, b);
+  return (c.tv_sec * 1000000000) + c.tv_nsec;
+}
+
+static inline uint64_t ts_to_ns(struct timespec ts) {
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
 static inline int ts_leq(struct timespec a, struct timespec b) {
   struct timespec ts = ts_sub(a, b);
   return (((signed long) ts.tv_sec) < 0
@@ -0,0 +1,95 @@
+#include "trace.h"
+#include "timespec.h"
+#include "cw_debug.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+__thread trace_ring_t *thr_trace_ring;
+
+static const char *trace_path;
+static trace_ring_t **trace_rings;
+static int trace_num_rings;
+static uint64_t trace_tsc0;
+static struct timespec trace_ts0;
+
+void trace_init(const char *path, unsigned long ring_events, int max_rings) {
+  unsigned long size = 1;
+  while (size < ring_events)
+    size *= 2;
+  check(size <= UINT32_MAX);
+
+  trace_path = path;
+  trace_num_rings = max_rings;
+  trace_rings = calloc(max_rings, sizeof(trace_ring_t *));
+  check(trace_rings != NULL);
+  for (int i = 0; i < max_rings; i++) {
+    trace_rings[i] = calloc(1, sizeof(trace_ring_t) + size * sizeof(trace_ev_t));
+    check(trace_rings[i] != NULL);
+    trace_rings[i]->size = size;
+    trace_rings[i]->id = i;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &trace_ts0);
+  trace_tsc0 = trace_tsc();
+}
+
+void trace_thread_init(int id) {
+  if (!trace_rings)
+    return;
+  assert(id < trace_num_rings);
+  thr_trace_ring = trace_rings[id];
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0)
+      return;
+    p += n;
+    len -= n;
+  }
+}
+
+// only uses async-signal-safe calls, so as to be usable from signal
+// handlers; events written concurrently with the dump may be torn
+void trace_dump() {
+  if (!trace_rings)
+    return;
+
+  struct timespec ts_now, ts_real;
+  clock_gettime(CLOCK_MONOTONIC, &ts_now);
+  uint64_t tsc_now = trace_tsc();
+  clock_gettime(CLOCK_REALTIME, &ts_real);
+  uint64_t elapsed_ns = ts_to_ns(ts_now) - ts_to_ns(trace_ts0);
+
+  int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+
+  trace_file_hdr_t hdr = {
+    .magic = TRACE_MAGIC,
+    .num_rings = trace_num_rings,
+    .tsc0 = trace_tsc0,
+    // realtime corresponding to tsc0
+    .ns0 = ts_to_ns(ts_real) - elapsed_ns,
+    .tsc_per_ns = elapsed_ns > 0 ? (double) (tsc_now - trace_tsc0) / elapsed_ns : 1.0,
+  };
+  write_all(fd, &hdr, sizeof(hdr));
+
+  for (int i = 0; i < trace_num_rings; i++) {
+    trace_ring_t *r = trace_rings[i];
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t num = head < r->size ? head : r->size;
+    trace_ring_hdr_t rh = { .id = r->id, .num_events = num };
+    write_all(fd, &rh, sizeof(rh));
+    uint64_t first = (head - num) & (r->size - 1);
+    uint64_t n1 = r->size - first < num ? r->size - first : num;
+    write_all(fd, &r->ev[first], n1 * sizeof(trace_ev_t));
+    write_all(fd, &r->ev[0], (num - n1) * sizeof(trace_ev_t));
+  }
+  close(fd);
+}
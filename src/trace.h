@@ -0,0 +1,99 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+// Low-overhead per-request event tracing: each thread appends
+// fixed-size binary events, stamped with the TSC, to its own lock-free
+// ring buffer (oldest events get overwritten), and the rings are
+// written to a binary file by trace_dump(), e.g., at exit or from a
+// signal handler. dw_trace2json converts the file to the Chrome trace
+// event JSON format, which can be loaded into chrome://tracing or
+// Perfetto.
+
+typedef enum {
+  TR_RECV,		// data received (arg: bytes)
+  TR_PARSE,		// complete message found in receive buffer (arg: req_size)
+  TR_COMPUTE_BEGIN,
+  TR_COMPUTE_END,
+  TR_STORE_BEGIN,
+  TR_STORE_END,
+  TR_LOAD_BEGIN,
+  TR_LOAD_END,
+  TR_SEND_BEGIN,	// arg: bytes
+  TR_SEND_END,
+  TR_NUM
+} trace_ev_type_t;
+
+typedef struct {
+  uint64_t tsc;
+  uint32_t req_id;
+  uint32_t arg;
+  uint16_t type;	// trace_ev_type_t
+  uint16_t pad[3];
+} trace_ev_t;
+
+typedef struct {
+  uint64_t head;	// number of events ever written, next slot is head % size
+  uint32_t size;	// power of 2
+  uint32_t id;
+  trace_ev_t ev[];
+} trace_ring_t;
+
+#define TRACE_MAGIC 0x3145434152545744ul	// "DWTRACE1"
+
+// file layout: trace_file_hdr_t, then for each ring a trace_ring_hdr_t
+// followed by its events, oldest first
+typedef struct {
+  uint64_t magic;
+  uint32_t num_rings;
+  uint32_t pad;
+  uint64_t tsc0;	// TSC at trace_init()
+  uint64_t ns0;		// CLOCK_REALTIME at trace_init() (ns)
+  double tsc_per_ns;	// TSC ticks per ns, calibrated at dump time
+} trace_file_hdr_t;
+
+typedef struct {
+  uint32_t id;
+  uint32_t num_events;
+} trace_ring_hdr_t;
+
+extern __thread trace_ring_t *thr_trace_ring;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t trace_tsc() {
+  return __rdtsc();
+}
+#else
+static inline uint64_t trace_tsc() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+#endif
+
+// Allocate max_rings rings of ring_events events each (rounded up to a
+// power of 2), to be dumped into path
+void trace_init(const char *path, unsigned long ring_events, int max_rings);
+
+// Make the calling thread log into ring id (no-op unless traced)
+void trace_thread_init(int id);
+
+// Write all rings to the trace file (async-signal-safe)
+void trace_dump();
+
+static inline void trace_ev(trace_ev_type_t type, uint32_t req_id, uint32_t arg) {
+  trace_ring_t *r = thr_trace_ring;
+  if (!r)
+    return;
+  trace_ev_t *e = &r->ev[r->head & (r->size - 1)];
+  e->tsc = trace_tsc();
+  e->req_id = req_id;
+  e->arg = arg;
+  e->type = type;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif